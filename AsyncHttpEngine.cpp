@@ -0,0 +1,232 @@
+#include "AsyncHttpEngine.h"
+#include "LocalUtility.h"
+#include <algorithm>
+
+AsyncHttpEngine::AsyncHttpEngine() :
+    m_multi(curl_multi_init()),
+    m_stop(true)
+{
+}
+
+AsyncHttpEngine::~AsyncHttpEngine()
+{
+    stop();
+    if (m_multi)
+    {
+        curl_multi_cleanup(m_multi);
+        m_multi = nullptr;
+    }
+}
+
+void AsyncHttpEngine::set_multiplexing(long max_host_connections, long max_concurrent_streams)
+{
+    if (!m_multi)
+    {
+        return;
+    }
+    curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+    curl_multi_setopt(m_multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_concurrent_streams);
+}
+
+void AsyncHttpEngine::set_connection_policy(const ngmp::common::ConnectionPolicy &policy)
+{
+    if (!m_multi)
+    {
+        return;
+    }
+    if (policy.max_streams_per_connection > 1)
+    {
+        set_multiplexing(policy.max_connections, policy.max_streams_per_connection);
+    }
+    else
+    {
+        curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)policy.max_connections);
+    }
+    m_max_idle_age = policy.idle_timeout;
+}
+
+bool AsyncHttpEngine::start()
+{
+    if (!m_multi || m_thread.joinable())
+    {
+        return false;
+    }
+    m_stop = false;
+    m_thread = std::thread(&AsyncHttpEngine::loop, this);
+    return true;
+}
+
+void AsyncHttpEngine::stop()
+{
+    if (!m_thread.joinable())
+    {
+        return;
+    }
+    m_stop = true;
+    curl_multi_wakeup(m_multi);
+    m_thread.join();
+
+    // the loop is gone, abort what is left on this thread
+    std::deque<Transfer> incoming;
+    {
+        std::lock_guard<std::mutex> lock(m_incoming_mtx);
+        incoming.swap(m_incoming);
+        m_canceled.clear();
+    }
+    for (Transfer &transfer : incoming)
+    {
+        transfer.completion(CURLE_ABORTED_BY_CALLBACK);
+    }
+    while (!m_running.empty())
+    {
+        finish(m_running.begin()->first, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+uint64_t AsyncHttpEngine::submit(const std::shared_ptr<HttpConnection> &connection, Completion completion)
+{
+    if (!connection || !completion)
+    {
+        return 0;
+    }
+    uint64_t id = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_incoming_mtx);
+        if (m_stop)
+        {
+            return 0;
+        }
+        id = ++m_last_transfer;
+        m_incoming.push_back(Transfer{id, connection, std::move(completion)});
+    }
+    curl_multi_wakeup(m_multi);
+    return id;
+}
+
+void AsyncHttpEngine::cancel(const std::shared_ptr<HttpConnection> &connection, uint64_t transfer)
+{
+    if (!connection || transfer == 0)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_incoming_mtx);
+        if (m_stop)
+        {
+            return;
+        }
+        m_canceled.emplace_back(connection->Handle(), transfer);
+    }
+    curl_multi_wakeup(m_multi);
+}
+
+void AsyncHttpEngine::loop()
+{
+#undef  __FUNC__
+#define __FUNC__ "AsyncHttpEngine::loop"
+
+    while (!m_stop)
+    {
+        add_incoming();
+        abort_canceled();
+
+        int running = 0;
+        CURLMcode mc = curl_multi_perform(m_multi, &running);
+        if (mc != CURLM_OK)
+        {
+            LOGx2("curl_multi_perform() failed, %d: %s", mc, curl_multi_strerror(mc));
+        }
+
+        int left = 0;
+        while (CURLMsg *msg = curl_multi_info_read(m_multi, &left))
+        {
+            if (msg->msg == CURLMSG_DONE)
+            {
+                finish(msg->easy_handle, msg->data.result);
+            }
+        }
+
+        curl_multi_poll(m_multi, nullptr, 0, poll_timeout, nullptr);
+    }
+}
+
+void AsyncHttpEngine::add_incoming()
+{
+#undef  __FUNC__
+#define __FUNC__ "AsyncHttpEngine::add_incoming"
+
+    std::deque<Transfer> incoming;
+    {
+        std::lock_guard<std::mutex> lock(m_incoming_mtx);
+        incoming.swap(m_incoming);
+    }
+    for (Transfer &transfer : incoming)
+    {
+        CURL *handle = transfer.connection->Handle();
+        if (m_max_idle_age > 0)
+        {
+            //the idle expiry of the pool, for the sockets of the multi handle
+            curl_easy_setopt(handle, CURLOPT_MAXAGE_CONN, m_max_idle_age);
+        }
+        CURLMcode mc = curl_multi_add_handle(m_multi, handle);
+        if (mc != CURLM_OK)
+        {
+            LOGx2("curl_multi_add_handle() failed, %d: %s", mc, curl_multi_strerror(mc));
+            transfer.completion(CURLE_FAILED_INIT);
+            continue;
+        }
+        m_running.emplace(handle, std::move(transfer));
+    }
+}
+
+void AsyncHttpEngine::abort_canceled()
+{
+    std::vector<std::pair<CURL*, uint64_t>> canceled;
+    std::vector<Transfer> aborted;
+    {
+        std::lock_guard<std::mutex> lock(m_incoming_mtx);
+        canceled.swap(m_canceled);
+
+        // submitted since the last add_incoming, it never reaches the multi handle
+        for (const std::pair<CURL*, uint64_t> &cancel : canceled)
+        {
+            auto iter = std::find_if(m_incoming.begin(), m_incoming.end(), [&cancel](const Transfer &transfer)
+                {
+                    return transfer.id == cancel.second && transfer.connection->Handle() == cancel.first;
+                });
+            if (iter != m_incoming.end())
+            {
+                aborted.push_back(std::move(*iter));
+                m_incoming.erase(iter);
+            }
+        }
+    }
+    for (Transfer &transfer : aborted)
+    {
+        transfer.completion(CURLE_ABORTED_BY_CALLBACK);
+    }
+    for (const std::pair<CURL*, uint64_t> &cancel : canceled)
+    {
+        // nothing to do when the transfer completed meanwhile, the handle may already run another one
+        auto iter = m_running.find(cancel.first);
+        if (iter != m_running.end() && iter->second.id == cancel.second)
+        {
+            finish(cancel.first, CURLE_ABORTED_BY_CALLBACK);
+        }
+    }
+}
+
+void AsyncHttpEngine::finish(CURL *handle, CURLcode result)
+{
+    auto iter = m_running.find(handle);
+    if (iter == m_running.end())
+    {
+        return;
+    }
+    Transfer transfer = std::move(iter->second);
+    m_running.erase(iter);
+    curl_multi_remove_handle(m_multi, handle);
+
+    transfer.completion(result);
+}
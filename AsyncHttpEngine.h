@@ -0,0 +1,100 @@
+#ifndef _ASYNCHTTPENGINE_H_
+#define _ASYNCHTTPENGINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <curl/curl.h>
+#include "HttpConnection.h"
+#include "./Util/ConnectionPool.h"
+
+/*
+ * One event loop thread driving any number of transfers on a curl_multi
+ * handle, so a few threads keep many requests in flight. The connection
+ * stays owned by the caller, the engine only borrows its easy handle until
+ * the completion is called. Completions run on the event loop thread and
+ * must not block.
+ *
+ * A handle added to the multi handle runs on the connection cache of the
+ * multi handle, not on the socket it keeps for the blocking path. The
+ * limits of the ConnectionPool (max_connections, idle expiry, warm-ups)
+ * therefore only hold for the blocking path; the sockets of the engine
+ * follow set_connection_policy.
+ */
+class AsyncHttpEngine final
+{
+public:
+    using Completion = std::function<void(CURLcode)>;
+
+    AsyncHttpEngine();
+    ~AsyncHttpEngine();
+
+    AsyncHttpEngine(const AsyncHttpEngine&) = delete;
+    AsyncHttpEngine& operator=(const AsyncHttpEngine&) = delete;
+
+    /*
+     * Multiplex transfers to the same host as HTTP/2 streams, at most
+     * max_host_connections sockets per host carrying max_concurrent_streams
+     * each. Call before start; keep it in line with the pool policy.
+    */
+    void set_multiplexing(long max_host_connections, long max_concurrent_streams);
+
+    /*
+     * Size the connection cache of the multi handle from the pool policy:
+     * at most max_connections sockets per host (0: unlimited), multiplexed
+     * when max_streams_per_connection is above 1, and closed once idle for
+     * idle_timeout. The limit is per host for every destination of the
+     * engine, pass the policy of the destination with the highest limit.
+     * Call before start.
+    */
+    void set_connection_policy(const ngmp::common::ConnectionPolicy &policy);
+
+    bool start();
+
+    // Transfers still running are aborted, their completion gets CURLE_ABORTED_BY_CALLBACK
+    void stop();
+
+    // The connection must be prepared by SetOptions or SetMultiPartOptions.
+    // The id of the transfer, for cancel, 0 when the engine is not started or stopping
+    uint64_t submit(const std::shared_ptr<HttpConnection> &connection, Completion completion);
+
+    // Abort transfer, submitted on connection, if it is still running, its completion gets
+    // CURLE_ABORTED_BY_CALLBACK. Too late, it does nothing, even to a later transfer of connection
+    void cancel(const std::shared_ptr<HttpConnection> &connection, uint64_t transfer);
+
+private:
+    struct Transfer
+    {
+        uint64_t id;
+        std::shared_ptr<HttpConnection> connection;
+        Completion completion;
+    };
+
+    void loop();
+    void add_incoming();
+    void abort_canceled();
+    void finish(CURL *handle, CURLcode result);
+
+private:
+    static const int poll_timeout = 1000; // millisecond, transfers also wake the loop up
+
+    CURLM *m_multi;
+    long m_max_idle_age = 0; // unit: second, 0: the default of curl
+    std::thread m_thread;
+    std::atomic<bool> m_stop;
+
+    std::mutex m_incoming_mtx;
+    std::deque<Transfer> m_incoming;
+    uint64_t m_last_transfer = 0;
+    std::vector<std::pair<CURL*, uint64_t>> m_canceled; // handle and id of the transfer to abort
+    std::unordered_map<CURL*, Transfer> m_running; // only touched by the event loop thread
+};
+
+#endif // _ASYNCHTTPENGINE_H_
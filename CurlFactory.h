@@ -9,9 +9,15 @@
 class CurlFactory : public ngmp::common::ConnectionFactory
 {
 public:
+    // share_cache: the connections of the pool share the DNS cache and TLS sessions,
+    // requires HTTPS_GLOBAL_INITIALIZE before the first connection is created
+    explicit CurlFactory(bool share_cache = false) : m_share_cache(share_cache)
+    {
+    }
+
     virtual std::shared_ptr<ngmp::common::Connection> create_connection() override
     {
-        std::shared_ptr<ngmp::common::Connection> connection(new HttpConnection(false, false),
+        std::shared_ptr<ngmp::common::Connection> connection(new HttpConnection(false, false, m_share_cache),
             [](ngmp::common::Connection *connection)
             {
                 if (connection)
@@ -27,6 +33,9 @@ public:
         }
         return connection;
     }
+
+private:
+    const bool m_share_cache;
 };
 
 #endif // _CURL_FACTORY_H_
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <iostream>
 
 const unsigned int FuseHttpClient::max_fuse_slide_window = 600;
+thread_local const FuseClient *FuseClient::t_recovery_probe = nullptr;
 
 FuseClient::FuseClient(const std::string &host, unsigned int port) :
     m_host(host),
@@ -11,16 +12,28 @@ FuseClient::FuseClient(const std::string &host, unsigned int port) :
     m_in_fuse_mode(false),
     m_inplace_retry_times(0),
     m_timeout(0),
-    m_latency_timeout(std::numeric_limits<unsigned int>::max())
+    m_connect_timeout(0),
+    m_latency_timeout(std::numeric_limits<unsigned int>::max()),
+    m_acquire_timeout(0)
 {
+    m_recovery_scheduler = RecoveryScheduler::instance();
 }
 
 FuseClient::~FuseClient()
 {
-    if (m_recovery_thread.joinable())
+    stop_recovery();
+}
+
+void FuseClient::stop_recovery()
+{
+    if (m_recovery_scheduler)
     {
-        m_in_fuse_mode = false;
-        m_recovery_thread.join();
+        m_recovery_scheduler->cancel(this);
+    }
+    if (m_recovering.exchange(false))
+    {
+        // nobody else would clear it for the clients sharing it
+        m_recovery_triggered->store(false);
     }
 }
 
@@ -32,6 +45,7 @@ void FuseClient::set_fuse(unsigned int slide_window,
     if (silde_window == 0)
     {
         m_timer_counter.reset();
+        m_success_counter.reset();
         LOGi1("Disable fuse mode for FuseHttpClient %s since the slide window is zero", destination().c_str());
         return;
     }
@@ -43,6 +57,7 @@ void FuseClient::set_fuse(unsigned int slide_window,
     }
 
     m_timer_counter.reset(new TimerCounter(1, silde_window));
+    m_success_counter.reset(new TimerCounter(1, silde_window));
 
     m_fuse_slide_window = silde_window;
     m_fuse_threshold = threshold;
@@ -53,42 +68,370 @@ void FuseClient::set_fuse(unsigned int slide_window,
           m_fuse_slide_window, m_fuse_threshold, m_fuse_recovery_interval, m_fuse_recovery_threshold);
 }
 
-void FuseClient::recovery_func()
+void FuseClient::set_fuse_latency(double percentile,
+                                  std::chrono::milliseconds threshold,
+                                  unsigned int window,
+                                  unsigned int min_requests)
 {
-    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + std::chrono::seconds(m_fuse_recovery_interval);
-
-    unsigned int recovery_count = 0;
-    while (m_in_fuse_mode)
+    if (window == 0)
     {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-        if (std::chrono::steady_clock::now() < next)
-        {
-            continue;
-        }
+        m_fuse_latency_window = 0;
+        m_latency_histogram.reset();
+        LOGi1("Disable latency fuse for %s since the window is zero", destination().c_str());
+        return;
+    }
+    if (window > max_fuse_slide_window)
+    {
+        window = max_fuse_slide_window;
+        LOGi1("Max fuse slide window in second is %u", max_fuse_slide_window);
+    }
+
+    m_fuse_latency_percentile = percentile;
+    m_fuse_latency_threshold = threshold;
+    m_fuse_latency_min_requests = min_requests;
+    m_latency_histogram.reset();
+    m_fuse_latency_window = window;
+
+    LOGd4("Latency fuse: p%g above %ldms in %u seconds, at least %u requests",
+          percentile, (long)threshold.count(), window, min_requests);
+}
 
-        LOGd1("%s in fuse mode, try a test", destination().c_str());
-        if (test())
+bool FuseClient::fuse_admit(const std::string &traceId)
+{
+    if (m_in_fuse_mode && !in_recovery_probe())
+    {
+        const std::shared_ptr<HalfOpenState> half_open = half_open_state();
+        bool admitted = false;
+        if (half_open->admit(admitted))
         {
-            ++recovery_count;
-            LOGi2("%s %u times successful test", destination().c_str(), recovery_count);
-            if (recovery_count >= m_fuse_recovery_threshold)
+            if (admitted)
             {
-                LOGi2("%s equal the threshold %u, leave fuse mode", destination().c_str(), m_fuse_recovery_threshold);
-                if (m_timer_counter)
-                {
-                    m_timer_counter->reset();
-                }
-                m_in_fuse_mode = false;
+                return true;
             }
+            LOGd1("%s In half-open fuse mode, ignore the request", traceId.c_str());
+            return false;
+        }
+        const uint64_t closes = m_half_open_closes.load();
+        if (closes != no_closes && closes != half_open->closes())
+        {
+            // another client of the destination completed the ramp
+            LOGd1("%s half-open ramp completed, leave fuse mode", traceId.c_str());
+            leave_fuse_mode();
+            return true;
         }
-        else
+        if (m_recovery_triggered->load())
         {
-            LOGx1("%s test failed", destination().c_str());
-            recovery_count = 0;
+            LOGd1("%s In fuse mode, ignore the request", traceId.c_str());
+            return false;
         }
+        m_half_open_closes = no_closes;
+        m_in_fuse_mode = false;
+        reset_fuse_counters();
+        LOGd1("%s leave fuse mode, and restart count", traceId.c_str());
+    }
+    return true;
+}
+
+void FuseClient::fuse_report_failure(const std::string &traceId)
+{
+    if (m_in_fuse_mode && !in_recovery_probe() && half_open_report(false, traceId))
+    {
+        return;
+    }
+    if (m_timer_counter && !in_recovery_probe())
+    {
+        m_timer_counter->add_count(1);
+        unsigned int failures = 0;
+        unsigned int requests = 0;
+        if (fuse_tripped(failures, requests) && enter_fuse_mode())
+        {
+            LOGx4("%s %u errors of %u requests in %u seconds, enter fuse mode", traceId.c_str(), failures, requests, m_fuse_slide_window);
+        }
+    }
+}
 
-        next = std::chrono::steady_clock::now() + std::chrono::seconds(m_fuse_recovery_interval);
+void FuseClient::fuse_report_latency(const std::string &traceId, std::chrono::microseconds latency)
+{
+    if (m_in_fuse_mode || in_recovery_probe())
+    {
+        return;
     }
+    const std::shared_ptr<WindowedLatencyHistogram> histogram = latency_histogram();
+    if (!histogram)
+    {
+        return;
+    }
+    histogram->record(latency);
 
+    if (!m_latency_percentile.update(*histogram, m_fuse_latency_percentile))
+    {
+        return;
+    }
+    const uint64_t requests = m_latency_percentile.requests();
+    const std::chrono::microseconds value = m_latency_percentile.value();
+    if (requests >= m_fuse_latency_min_requests && value > m_fuse_latency_threshold && enter_fuse_mode())
+    {
+        LOGx4("%s p%g latency %ldms of %lu requests above the threshold, enter fuse mode",
+              traceId.c_str(), m_fuse_latency_percentile,
+              (long)std::chrono::duration_cast<std::chrono::milliseconds>(value).count(),
+              (unsigned long)requests);
+    }
+}
+
+bool FuseClient::enter_fuse_mode()
+{
+    // read first, a ramp completed after the switch must not be missed
+    const uint64_t closes = half_open_state()->closes();
+    bool expected = false;
+    if (!m_in_fuse_mode.compare_exchange_strong(expected, true))
+    {
+        return false;
+    }
+    m_half_open_closes = closes;
+    if (!m_recovery_triggered)
+    {
+        m_recovery_triggered = std::make_shared<std::atomic<bool>>(false);
+    }
+    if (m_recovery_triggered->compare_exchange_strong(expected, true))
+    {
+        m_recovering = true;
+        schedule_recovery();
+    }
+    return true;
+}
+
+void FuseClient::fuse_report_success()
+{
+    if (m_in_fuse_mode && !in_recovery_probe() && half_open_report(true, ""))
+    {
+        return;
+    }
+    if (m_success_counter && !in_recovery_probe())
+    {
+        m_success_counter->add_count(1);
+    }
+}
+
+bool FuseClient::fuse_tripped(unsigned int &failures, unsigned int &requests)
+{
+    failures = m_timer_counter->get_sum_of_last_slices(m_fuse_slide_window);
+    if (m_fuse_failure_ratio <= 0)
+    {
+        requests = failures;
+        return failures >= m_fuse_threshold;
+    }
+    requests = failures + m_success_counter->get_sum_of_last_slices(m_fuse_slide_window);
+    return requests >= m_fuse_min_requests && failures >= m_fuse_failure_ratio * requests;
+}
+
+void FuseClient::reset_fuse_counters()
+{
+    if (m_timer_counter)
+    {
+        m_timer_counter->reset();
+    }
+    if (m_success_counter)
+    {
+        m_success_counter->reset();
+    }
+    const std::shared_ptr<WindowedLatencyHistogram> histogram = latency_histogram();
+    if (histogram)
+    {
+        histogram->reset();
+    }
+}
+
+void FuseClient::leave_fuse_mode()
+{
+    m_half_open_closes = no_closes;
+    if (!m_in_fuse_mode.exchange(false))
+    {
+        return;
+    }
+    reset_fuse_counters();
+    m_recovering = false;
     m_recovery_triggered->store(false);
 }
+
+bool FuseClient::enter_half_open()
+{
+    const std::shared_ptr<HalfOpenState> half_open = half_open_state();
+    if (!half_open->enter(m_half_open_ramp, m_half_open_step_requests, m_half_open_success_ratio))
+    {
+        return false;
+    }
+    LOGi2("%s half-open, let %d%% of the requests through", destination().c_str(), half_open->percent());
+    return true;
+}
+
+bool FuseClient::half_open_report(bool success, const std::string &traceId)
+{
+    unsigned int percent = 0;
+    unsigned int failures = 0;
+    switch (half_open_state()->report(success, percent, failures))
+    {
+        case HalfOpenState::HALF_OPEN_INACTIVE:
+            return false;
+        case HalfOpenState::HALF_OPEN_COUNTED:
+            return true;
+        case HalfOpenState::HALF_OPEN_NEXT:
+            LOGi2("%s half-open, let %u%% of the requests through", destination().c_str(), percent);
+            return true;
+        case HalfOpenState::HALF_OPEN_REOPEN:
+            // the client which saw the step fail drives the recovery from here
+            LOGx3("%s %u failures at %u%% in half-open, enter fuse mode again", traceId.c_str(), failures, percent);
+            m_recovering = true;
+            schedule_recovery();
+            return true;
+        case HalfOpenState::HALF_OPEN_CLOSE:
+            // the other clients of the destination leave fuse mode on their next request
+            LOGi1("%s half-open ramp completed, leave fuse mode", destination().c_str());
+            leave_fuse_mode();
+            return true;
+    }
+    return true;
+}
+
+std::chrono::steady_clock::time_point FuseClient::request_deadline() const
+{
+    const unsigned int timeout = m_timeout.load();
+    return timeout == 0 ? std::chrono::steady_clock::time_point::max() :
+           std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+}
+
+std::shared_ptr<ngmp::common::Connection> FuseClient::get_connection(std::chrono::steady_clock::time_point deadline)
+{
+    return get_connection(destination(), deadline);
+}
+
+std::shared_ptr<ngmp::common::Connection> FuseClient::get_connection(const std::string &pool_destination,
+                                                                     std::chrono::steady_clock::time_point deadline)
+{
+    if (!m_connection_pool)
+    {
+        return nullptr;
+    }
+    const unsigned int acquire_timeout = m_acquire_timeout.load();
+    if (acquire_timeout == 0)
+    {
+        return m_connection_pool->get_connection(pool_destination, deadline);
+    }
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (deadline <= now)
+    {
+        return m_connection_pool->get_connection(pool_destination, std::chrono::milliseconds::zero());
+    }
+    std::chrono::milliseconds timeout(acquire_timeout);
+    if (deadline != std::chrono::steady_clock::time_point::max())
+    {
+        timeout = std::min(timeout, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+    }
+    return m_connection_pool->get_connection(pool_destination, timeout);
+}
+
+void FuseClient::set_endpoints(const std::vector<std::string> &endpoints)
+{
+    const std::vector<std::string> removed = endpoint_set()->set_endpoints(endpoints);
+    link_endpoints();
+    if (m_connection_pool)
+    {
+        for (const std::string &endpoint : removed)
+        {
+            m_connection_pool->unlink(endpoint);
+        }
+    }
+}
+
+void FuseClient::link_endpoints()
+{
+    if (!m_connection_pool)
+    {
+        return;
+    }
+    for (const std::shared_ptr<const EndpointSet::Endpoint> &endpoint : endpoint_set()->endpoints())
+    {
+        m_connection_pool->link(endpoint->address(), destination());
+    }
+}
+
+std::shared_ptr<EndpointSet> FuseClient::endpoint_set()
+{
+    return m_endpoint_set.get([this]() { return EndpointSet::of(destination()); });
+}
+
+std::shared_ptr<HalfOpenState> FuseClient::half_open_state()
+{
+    return m_half_open_state.get([this]() { return HalfOpenState::of(destination()); });
+}
+
+std::shared_ptr<WindowedLatencyHistogram> FuseClient::latency_histogram()
+{
+    const unsigned int window = m_fuse_latency_window.load();
+    if (window == 0)
+    {
+        return nullptr;
+    }
+    return m_latency_histogram.get([this, window]()
+        {
+            return WindowedLatencyHistogram::of(destination(), std::chrono::seconds(1), window);
+        });
+}
+
+void FuseClient::rebind_destination()
+{
+    m_endpoint_set.reset();
+    m_half_open_state.reset();
+    m_latency_histogram.reset();
+}
+
+void FuseClient::schedule_recovery()
+{
+    m_recovery_scheduler->schedule(this, std::chrono::steady_clock::now() + std::chrono::seconds(m_fuse_recovery_interval),
+        [this]()
+        {
+            recovery_probe();
+        });
+}
+
+void FuseClient::recovery_probe()
+{
+    if (!m_in_fuse_mode)
+    {
+        m_recovery_count = 0;
+        m_recovering = false;
+        m_recovery_triggered->store(false);
+        return;
+    }
+
+    if (enter_half_open())
+    {
+        // the live traffic of every client of the destination decides from here, the one seeing
+        // the ramp complete closes the fuse for all, the one seeing a step fail opens it again
+        m_recovering = false;
+        return;
+    }
+
+    LOGd1("%s in fuse mode, try a test", destination().c_str());
+    t_recovery_probe = this;
+    const bool healthy = test();
+    t_recovery_probe = nullptr;
+    if (healthy)
+    {
+        ++m_recovery_count;
+        LOGi2("%s %u times successful test", destination().c_str(), m_recovery_count);
+        if (m_recovery_count >= m_fuse_recovery_threshold)
+        {
+            LOGi2("%s equal the threshold %u, leave fuse mode", destination().c_str(), m_fuse_recovery_threshold);
+            m_recovery_count = 0;
+            leave_fuse_mode();
+            return;
+        }
+    }
+    else
+    {
+        LOGx1("%s test failed", destination().c_str());
+        m_recovery_count = 0;
+    }
+
+    schedule_recovery();
+}
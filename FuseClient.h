@@ -5,8 +5,17 @@
 #include <atomic>
 #include <thread>
 #include <string>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <vector>
 #include "./Util/ConnectionPool.h"
 #include "./Util/TimerCounter.h"
+#include "./Util/WindowedLatencyHistogram.h"
+#include "./Util/RecoveryScheduler.h"
+#include "./Util/EndpointSet.h"
+#include "./Util/HalfOpenState.h"
+#include "./Util/DestinationRegistry.h"
 
 class FuseClient
 {
@@ -22,24 +31,109 @@ public:
                   unsigned int recovery_interval,
                   unsigned int recovery_threshold);
 
+    /*
+     * Trip on the failure ratio over the slide window instead of the absolute
+     * threshold, once the window holds at least min_requests requests, so the
+     * fuse behaves the same at low and high traffic. failure_ratio in (0, 1],
+     * 0 goes back to the threshold of set_fuse. Call after set_fuse.
+    */
+    void set_fuse_ratio(double failure_ratio, unsigned int min_requests)
+    {
+        m_fuse_failure_ratio = failure_ratio;
+        m_fuse_min_requests = min_requests;
+    }
+
+    /*
+     * Also trip when the percentile (e.g. 99) of the request latency over the
+     * last window seconds is above threshold, once the window holds at least
+     * min_requests requests. Unlike set_latency_timeout, a single slow
+     * request does not count, a sustained slowdown does. The latencies of
+     * every client of the destination with the same window are taken
+     * together, a client sending few requests still sees a slowdown the
+     * others measure. window 0: off
+    */
+    void set_fuse_latency(double percentile,
+                          std::chrono::milliseconds threshold,
+                          unsigned int window,
+                          unsigned int min_requests);
+
+    /*
+     * Recover through a half-open state instead of test() probes. After
+     * recovery_interval, ramp[0] percent of the live requests are let through,
+     * e.g. {1, 10, 50, 100}. Once step_requests of them completed with at least
+     * step_success_ratio successes the next step is taken, the last one closes
+     * the fuse. Too many failures in a step open it again for another
+     * recovery_interval. Steps are clamped to [1, 100], a step of 0 would
+     * admit nothing and never end. An empty ramp goes back to test() probes.
+     * The state is shared by every client of the destination, see
+     * half_open_state().
+    */
+    void set_half_open(const std::vector<unsigned int> &ramp,
+                       unsigned int step_requests,
+                       double step_success_ratio)
+    {
+        m_half_open_ramp = ramp;
+        for (unsigned int &step : m_half_open_ramp)
+        {
+            step = std::min(std::max(step, 1u), 100u);
+        }
+        m_half_open_step_requests = std::max(step_requests, 1u);
+        m_half_open_success_ratio = step_success_ratio;
+    }
+
     void set_host(const std::string &host)
     {
         m_host = host;
+        rebind_destination();
     }
 
     void set_port(unsigned int port)
     {
         m_port = port;
+        rebind_destination();
     }
 
+    /*
+     * Spread the requests over the replicas of the destination, given as
+     * address:port, e.g. from EndpointSet::resolve(host, port). Every endpoint
+     * has its own pool in the connection pool, keyed by its address, which
+     * follows the pool policy of destination(), and its own health in
+     * endpoint_set(). The pools of endpoints left out of a later call are
+     * unlinked and their idle connections closed. Requests keep
+     * destination() as Host. Empty: back to host and port.
+    */
+    void set_endpoints(const std::vector<std::string> &endpoints);
+
+    // Shared by every client of this destination, bound at the first call
+    std::shared_ptr<EndpointSet> endpoint_set();
+
+    // Shared by every client of this destination, bound at the first call
+    std::shared_ptr<HalfOpenState> half_open_state();
+
     void set_inplace_retry_times(unsigned int num)
     {
         m_inplace_retry_times = num;
     }
 
+    // unit: second, same as set_deadline(std::chrono::seconds(timeout))
     void set_timeout(unsigned int timeout)
     {
-        m_timeout = timeout;
+        set_deadline(std::chrono::seconds(timeout));
+    }
+
+    // Budget of a whole request: pool acquire, connect and transfer of every
+    // in-place retry, each attempt only gets what is left. 0: no deadline,
+    // longer than the counter holds saturates instead of wrapping to a short one
+    void set_deadline(std::chrono::milliseconds deadline)
+    {
+        const std::chrono::milliseconds::rep max_timeout = std::numeric_limits<unsigned int>::max();
+        m_timeout = (unsigned int)std::min(std::max(deadline.count(), (std::chrono::milliseconds::rep)0), max_timeout);
+    }
+
+    // Cap of the connect phase of an attempt, within the deadline. 0: curl default
+    void set_connect_timeout(std::chrono::milliseconds connect_timeout)
+    {
+        m_connect_timeout = connect_timeout.count();
     }
 
     void set_latency_timeout(unsigned int latency_timeout)
@@ -47,14 +141,28 @@ public:
         m_latency_timeout = latency_timeout;
     }
 
+    // Wait for a pooled connection, within the deadline. 0: acquire_timeout of the pool policy
+    void set_acquire_timeout(std::chrono::milliseconds acquire_timeout)
+    {
+        m_acquire_timeout = acquire_timeout.count();
+    }
+
     void set_recovery_triggered(const std::shared_ptr<std::atomic<bool>> &recovery_triggered)
     {
         m_recovery_triggered = recovery_triggered;
     }
 
+    // RecoveryScheduler::instance() by default
+    void set_recovery_scheduler(const std::shared_ptr<RecoveryScheduler> &recovery_scheduler)
+    {
+        m_recovery_scheduler = recovery_scheduler;
+    }
+
+    // the pools of the endpoints already set follow the policy of destination() in it
     void set_connection_pool(const std::shared_ptr<ngmp::common::ConnectionPool> &connection_pool)
     {
         m_connection_pool = connection_pool;
+        link_endpoints();
     }
 
     std::string destination() const
@@ -65,12 +173,80 @@ public:
 private:
     virtual bool test() = 0;
 
-    bool in_recovery_thread() const
+    void schedule_recovery();
+
+    // the pool of every endpoint follows the policy of destination()
+    void link_endpoints();
+
+    // one health probe, runs on the recovery scheduler every recovery_interval while in fuse mode
+    void recovery_probe();
+
+    bool fuse_tripped(unsigned int &failures, unsigned int &requests);
+
+    void reset_fuse_counters();
+
+    // true when this call switched to fuse mode
+    bool enter_fuse_mode();
+
+    // also clears the recovery trigger, the destination is healthy again
+    void leave_fuse_mode();
+
+    // false when the ramp is empty, test() probes recover instead
+    bool enter_half_open();
+
+    // false when the destination is not half-open
+    bool half_open_report(bool success, const std::string &traceId);
+
+protected:
+    // destination() changed, drop what was bound to the previous one
+    virtual void rebind_destination();
+
+    // of the latency fuse, null while it is off
+    std::shared_ptr<WindowedLatencyHistogram> latency_histogram();
+
+    // true while test() runs
+    bool in_recovery_probe() const
+    {
+        return t_recovery_probe == this;
+    }
+
+    // no probe runs after this returns, to be called first by the destructor of a class implementing test()
+    void stop_recovery();
+
+    // false when the request must be dropped since the destination is in fuse mode
+    bool fuse_admit(const std::string &traceId);
+
+    // count a failed or too slow request, enter fuse mode at the threshold
+    void fuse_report_failure(const std::string &traceId);
+
+    // count a healthy request, the volume the failure ratio is taken from
+    void fuse_report_success();
+
+    // latency of an attempt, for set_fuse_latency
+    void fuse_report_latency(const std::string &traceId, std::chrono::microseconds latency);
+
+    // time_point::max() without a deadline
+    std::chrono::steady_clock::time_point request_deadline() const;
+
+    std::shared_ptr<ngmp::common::Connection> get_connection(
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+    // from the pool of pool_destination, an endpoint address or destination()
+    std::shared_ptr<ngmp::common::Connection> get_connection(const std::string &pool_destination,
+                                                             std::chrono::steady_clock::time_point deadline);
+
+    // endpoint of the next attempt, the less loaded of two, avoid only when nothing else is left.
+    // Empty without endpoints, the request then goes to destination()
+    EndpointSet::Lease pick_endpoint(const EndpointSet::Endpoint *avoid = nullptr)
     {
-        return m_recovery_thread.get_id() == std::this_thread::get_id();
+        return EndpointSet::pick(endpoint_set(), avoid);
     }
 
-    void recovery_func();
+    // the pool, and the address, of the requests sent to endpoint
+    std::string pool_destination(const EndpointSet::Lease &endpoint) const
+    {
+        return endpoint ? endpoint.address() : destination();
+    }
 
 public:
     static const unsigned int max_fuse_slide_window;
@@ -79,20 +255,43 @@ protected:
     std::shared_ptr<ngmp::common::ConnectionPool> m_connection_pool;
     std::string m_host;
     unsigned int m_port;
+    DestinationBinding<EndpointSet> m_endpoint_set;
 
     std::atomic<bool> m_in_fuse_mode;
-    std::unique_ptr<TimerCounter> m_timer_counter;
+    std::unique_ptr<TimerCounter> m_timer_counter; // failures
+    std::unique_ptr<TimerCounter> m_success_counter;
+    DestinationBinding<WindowedLatencyHistogram> m_latency_histogram; // shared by the clients of the destination
+    std::atomic<unsigned int> m_fuse_latency_window{0}; // unit: second, 0: off
+    CachedPercentile m_latency_percentile;
     std::shared_ptr<std::atomic<bool>> m_recovery_triggered;
-    std::thread m_recovery_thread;
+    std::shared_ptr<RecoveryScheduler> m_recovery_scheduler;
+    std::atomic<bool> m_recovering{false}; // this client triggered the recovery in progress
+    unsigned int m_recovery_count = 0;     // successful probes in a row, only touched by the probe
+
+    static thread_local const FuseClient *t_recovery_probe;
+
+    DestinationBinding<HalfOpenState> m_half_open_state;
+    static constexpr uint64_t no_closes = std::numeric_limits<uint64_t>::max();
+    std::atomic<uint64_t> m_half_open_closes{no_closes}; // closes() when entering fuse mode, no_closes out of it
 
-    std::atomic<unsigned int> m_timeout; // unit: second
+    std::atomic<unsigned int> m_timeout; // unit: millisecond, 0: no deadline
+    std::atomic<unsigned int> m_connect_timeout; // unit: millisecond
     std::atomic<unsigned int> m_latency_timeout; // unit: millisecond
     std::atomic<unsigned int> m_inplace_retry_times;
+    std::atomic<unsigned int> m_acquire_timeout; // unit: millisecond, 0: acquire_timeout of the pool policy
 
     unsigned int m_fuse_slide_window;
     unsigned int m_fuse_threshold;
     unsigned int m_fuse_recovery_interval;
     unsigned int m_fuse_recovery_threshold;
+    double m_fuse_failure_ratio = 0;
+    double m_fuse_latency_percentile = 99;
+    std::chrono::milliseconds m_fuse_latency_threshold{0};
+    unsigned int m_fuse_latency_min_requests = 0;
+    unsigned int m_fuse_min_requests = 0;
+    std::vector<unsigned int> m_half_open_ramp; // percent of the requests let through at each step
+    unsigned int m_half_open_step_requests = 1;
+    double m_half_open_success_ratio = 1;
 };
 
 #endif // _FUSECLIENT_H
@@ -1,4 +1,5 @@
 #include <UUID.h>
+#include <algorithm>
 #include <chrono>
 
 #include "FuseHttpClient.h"
@@ -8,14 +9,22 @@ const std::string FuseHttpClient::albTraceIdName = "X-Amzn-Trace-Id";
 const std::string FuseHttpClient::contentType = "Content-Type";
 const std::string FuseHttpClient::multiPartFormData = "multipart/form-data";
 const std::string FuseHttpClient::jsonData = "application/json";
+const std::string FuseHttpClient::hostName = "Host";
 
 FuseHttpClient::FuseHttpClient(const std::string &host, unsigned int port)
-    : FuseClient(host, port)
+    : FuseClient(host, port),
+      m_retry_policy(std::make_shared<ExponentialBackoffRetry>())
 {
 }
 
 FuseHttpClient::~FuseHttpClient()
 {
+    //a late completion may still trip the fuse and schedule a probe, drain them first
+    {
+        std::unique_lock<std::mutex> lock(m_async_mtx);
+        m_async_condition.wait(lock, [this]() { return m_async_pending == 0; });
+    }
+    stop_recovery();
 }
 
 
@@ -25,62 +34,135 @@ long FuseHttpClient::do_request(const std::string &path,
                                 const Body &data,
                                 std::string &response)
 {
+    ResponseLease lease;
+    const long code = do_request(path, method, headers, data, lease);
+    response.assign(lease.body().data(), lease.body().size());
+    return code;
+}
 
-    //traceId
-    std::string traceId;
-    Headers::const_iterator iter = headers.find(traceIdName);
-    if (iter != headers.cend())
-    {
-        traceId = iter->second;
-    }
-    else
-    {
-        GenUUID(traceId);
-        headers[traceIdName] = traceId;
-        LOGd1("%s Without trace-id", traceId.c_str());
-    }
-    headers[albTraceIdName] = "Root=" + traceId;
+long FuseHttpClient::do_request(const std::string &path,
+                                HTTP_REQUEST_METHOD method,
+                                Headers &headers,
+                                const Body &data,
+                                ResponseLease &response)
+{
+    return perform_request(path, method, headers, data, response, nullptr);
+}
+
+long FuseHttpClient::do_request(const std::string &path,
+                                HTTP_REQUEST_METHOD method,
+                                Headers &headers,
+                                const Body &data,
+                                const ResponseSink &sink)
+{
+    //the lease only holds the connection, the body went to the sink
+    ResponseLease lease;
+    return perform_request(path, method, headers, data, lease, &sink);
+}
+
+long FuseHttpClient::perform_request(const std::string &path,
+                                     HTTP_REQUEST_METHOD method,
+                                     Headers &headers,
+                                     const Body &data,
+                                     ResponseLease &response,
+                                     const ResponseSink *sink)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::perform_request"
+
+    response.reset();
+    const std::string traceId = prepare_trace_id(headers);
 
     long code = -1;
-    HTTP_ERROR_CODE err;
-    if (m_in_fuse_mode && !in_recovery_thread())
+    HTTP_ERROR_CODE err = HTTP_UNKNOWN;
+    if (!fuse_admit(traceId))
     {
-        if (m_recovery_triggered->load())
-        {
-            LOGd1("%s In fuse mode, ignore the request", traceId.c_str());
-            response.clear();
-            return code;
-        }
-        m_in_fuse_mode = false;
-        if (m_timer_counter)
-        {
-            m_timer_counter->reset();
-        }
-        LOGd1("%s leave fuse mode, and restart count", traceId.c_str());
+        return code;
     }
 
-    std::shared_ptr<ngmp::common::Connection> connection;
-    if (m_connection_pool)
+    //one budget for the acquire, connect and transfer of every attempt
+    const std::chrono::steady_clock::time_point deadline = request_deadline();
+    ConcurrencyLimiter::Permit permit;
+    if (!acquire_permit(traceId, deadline, permit))
     {
-        connection = m_connection_pool->get_connection(destination());
+        return code;
     }
+
+    EndpointSet::Lease endpoint = pick_endpoint();
+    std::string pool = pool_destination(endpoint);
+    std::shared_ptr<ngmp::common::Connection> connection = get_connection(pool, deadline);
     if (!connection)
     {
         LOGx1("%s Not get valid connection from pool", traceId.c_str());
-        response.clear();
         return code;
     }
+    if (endpoint)
+    {
+        //the address of a replica is in the URL, the virtual host stays the destination
+        headers[hostName] = destination();
+    }
 
     std::shared_ptr<HttpClient> client = std::dynamic_pointer_cast<HttpClient>(connection);
-    const unsigned int inplace_retry_times = in_recovery_thread() ? 0 : m_inplace_retry_times.load();
+    const EndpointSet::Endpoint *failed_endpoint = nullptr;
+    const unsigned int inplace_retry_times = in_recovery_probe() ? 0 : m_inplace_retry_times.load();
+    const std::shared_ptr<const RetryPolicy> retry_policy = std::atomic_load(&m_retry_policy);
+    //a hedge races the attempt on the engine, a sink would be fed by both
+    const bool hedged = m_hedging && method == HTTP_GET && !sink && m_async_engine && !in_recovery_probe();
+    std::chrono::milliseconds backoff(0);
     int64_t max_latency = 0;
+    std::chrono::microseconds rtt(0);
+    bool slow_phase = false;
+    bool broken = false;
+    bool retry_taken = false; // a retry token is held for an attempt not sent yet
+    size_t streamed = 0;
+    const ResponseSink counting_sink = [sink, &streamed](const char *chunk, size_t size)
+    {
+        streamed += size;
+        return (*sink)(chunk, size);
+    };
+    const PrepareAttempt prepare = [this, &data, &traceId, &path, method, &headers](const std::shared_ptr<HttpClient> &client,
+                                                                                    const std::string &address,
+                                                                                    std::chrono::milliseconds timeout)
+    {
+        client->SetHeaderTemplate(std::atomic_load(&m_header_template));
+        data.prepare(client, traceId, "http://" + address + path, method, timeout, headers);
+        client->SetConnectTimeout(connect_timeout(timeout));
+    };
     for (unsigned int i = 0; i <= inplace_retry_times; ++i)
     {
-        response.clear();
+        if (!connection)
+        {
+            endpoint = pick_endpoint(failed_endpoint);
+            pool = pool_destination(endpoint);
+            connection = get_connection(pool, deadline);
+            if (!connection)
+            {
+                LOGx1("%s Not get valid connection from pool for retry", traceId.c_str());
+                break;
+            }
+            client = std::dynamic_pointer_cast<HttpClient>(connection);
+        }
+
+        std::chrono::milliseconds timeout;
+        if (!attempt_timeout(deadline, timeout))
+        {
+            LOGx2("%s deadline of %ums exceeded, no more attempt", traceId.c_str(), m_timeout.load());
+            if (i == 0)
+            {
+                //nothing sent, a retry keeps the outcome of the attempt before it
+                err = HTTP_DEADLINE_EXCEEDED;
+            }
+            break;
+        }
 
         //do request
-        const std::string URI = "http://" + destination() + path;
-        data.prepare(client, traceId, URI, method, m_timeout.load(), headers);
+        retry_taken = false;
+        prepare(client, pool, timeout);
+        std::string URI = "http://" + pool + path;
+        if (sink)
+        {
+            client->SetResponseSink(counting_sink);
+        }
 
         LOGd3("%s Do request: %s %s", traceId.c_str(), HttpClient::methodName(method).c_str(), URI.c_str());
         for (const std::pair<const std::string, const std::string> &header : headers)
@@ -88,74 +170,704 @@ long FuseHttpClient::do_request(const std::string &path,
             LOGd3("%s Request header %s : %s", traceId.c_str(), header.first.c_str(), header.second.c_str());
         }
 
+        //a hedged attempt is timed end to end, hedge delay and cancel of the loser included, as the caller sees it
         std::chrono::time_point<std::chrono::steady_clock> startTime = std::chrono::steady_clock::now();
         code = 0;
-        err = client->SendRequest(code);
-        if (client->GetResponseBody())
-        {
-            response = client->GetResponseBody();
-        }
+        err = hedged ? send_hedged(traceId, prepare, deadline, endpoint, pool, connection, client, code) : send_request(client, code, sink != nullptr);
         std::chrono::time_point<std::chrono::steady_clock> endTime = std::chrono::steady_clock::now();
         auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
         max_latency = std::max(max_latency, latency);
+        rtt = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
+        fuse_report_latency(traceId, std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime));
+        const bool attempt_slow = record_timings(client, traceId, !hedged);
+        slow_phase = attempt_slow || slow_phase;
+        if (hedged)
+        {
+            URI = "http://" + pool + path; //the hedge may have won on another endpoint
+        }
+        failed_endpoint = endpoint.endpoint();
+        if (endpoint.release(!is_failure(err, latency, attempt_slow)))
+        {
+            LOGx2("%s endpoint %s ejected after consecutive failures", traceId.c_str(), pool.c_str());
+        }
 
+        //the body stays in the buffer of the connection, no copy, and is NUL terminated
+        const std::string_view body = response_body(client);
+        broken = err == HTTP_NETWORK_ERROR || err == HTTP_TIMEOUT;
         if (err == HTTP_SUCCESS)
         {
-            LOGd5("%s request URL: %s, response: %ld %s, latency: %ldms", traceId.c_str(), URI.c_str(), code, response.c_str(), latency);
+            LOGd5("%s request URL: %s, response: %ld %s, latency: %ldms", traceId.c_str(), URI.c_str(), code, body.data(), latency);
+            retry_budget()->on_success();
+            if (hedged)
+            {
+                hedge_budget()->on_success();
+            }
             break;
         }
         else
         {
             LOGx4("%s request URL: %s, response: %s, latency: %ldms",
-                    traceId.c_str(), URI.c_str(), std::to_string(code).append(" ").append(response).c_str(), latency);
-            if (err == HTTP_CLIENT_ERROR)
+                    traceId.c_str(), URI.c_str(), std::to_string(code).append(" ").append(body).c_str(), latency);
+            if (i == inplace_retry_times || !retry_policy->retryable(err))
             {
                 break;
             }
+            if (streamed > 0)
+            {
+                //the sink already consumed part of the body, a retry would feed it twice
+                LOGx2("%s %zu bytes streamed before the failure, no retry", traceId.c_str(), streamed);
+                break;
+            }
+            backoff = retry_policy->backoff(i + 1, backoff);
+            std::chrono::milliseconds left;
+            if (!attempt_timeout(deadline, left) ||
+                (left != std::chrono::milliseconds::zero() && left <= backoff))
+            {
+                LOGx2("%s no time left for a retry after %ldms backoff", traceId.c_str(), (long)backoff.count());
+                break;
+            }
+            //the token is only taken for a retry that fits the deadline
+            if (!retry_budget()->try_retry())
+            {
+                LOGx2("%s retry budget of %s spent, no retry", traceId.c_str(), destination().c_str());
+                break;
+            }
+            retry_taken = true;
+            if (broken)
+            {
+                //the socket may be dead, never hand it to the next caller, retry on a fresh connection
+                m_connection_pool->discard_connection(pool, connection);
+                connection.reset();
+                client.reset();
+            }
+            else if (failed_endpoint || backoff > std::chrono::milliseconds::zero())
+            {
+                //retry on another replica when there is one, and never pin a pooled connection while sleeping
+                m_connection_pool->release_connection(pool, connection);
+                connection.reset();
+                client.reset();
+            }
+            if (backoff > std::chrono::milliseconds::zero())
+            {
+                std::this_thread::sleep_for(backoff);
+            }
+        }
+    }
+    if (retry_taken)
+    {
+        //no connection or no time left for the retry, the token goes back to the other callers
+        retry_budget()->refund();
+    }
+    if (client)
+    {
+        //the lease gives a healthy connection back to the pool once the body has been read
+        if (broken)
+        {
+            m_connection_pool->discard_connection(pool, connection);
+            response.m_client = client;
+        }
+        else
+        {
+            response.m_connection_pool = m_connection_pool;
+            response.m_destination = pool;
+            response.m_client = client;
         }
     }
-    if (!m_connection_pool->release_connection(destination(), connection))
+
+    if (err == HTTP_DEADLINE_EXCEEDED)
     {
-        LOGx1("%s fail to release connection", traceId.c_str());
+        //the time went before the send, neither the fuse nor the concurrency limit learn from it
         return code;
     }
+    if (is_failure(err, max_latency, slow_phase))
+    {
+        fuse_report_failure(traceId);
+    }
+    else
+    {
+        fuse_report_success();
+    }
+    permit.release(rtt, is_dropped(err));
+
+    return code;
+}
+
+bool FuseHttpClient::attempt_timeout(std::chrono::steady_clock::time_point deadline, std::chrono::milliseconds &timeout)
+{
+    timeout = std::chrono::milliseconds::zero();
+    if (deadline == std::chrono::steady_clock::time_point::max())
+    {
+        return true;
+    }
+    timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return timeout > std::chrono::milliseconds::zero();
+}
+
+std::chrono::milliseconds FuseHttpClient::connect_timeout(std::chrono::milliseconds timeout) const
+{
+    const std::chrono::milliseconds connect_timeout(m_connect_timeout.load());
+    if (timeout == std::chrono::milliseconds::zero() || connect_timeout == std::chrono::milliseconds::zero())
+    {
+        return connect_timeout;
+    }
+    return std::min(connect_timeout, timeout);
+}
 
-    if ((err != HTTP_SUCCESS && err != HTTP_CLIENT_ERROR) || max_latency > m_latency_timeout)
+std::shared_ptr<RequestStats> FuseHttpClient::request_stats()
+{
+    return m_request_stats.get([this]() { return RequestStats::of(destination()); });
+}
+
+bool FuseHttpClient::acquire_permit(const std::string &traceId,
+                                    std::chrono::steady_clock::time_point deadline,
+                                    ConcurrencyLimiter::Permit &permit)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::acquire_permit"
+
+    if (!m_concurrency_limit || in_recovery_probe())
+    {
+        return true;
+    }
+    std::chrono::milliseconds wait(m_concurrency_wait.load());
+    std::chrono::milliseconds left;
+    if (!attempt_timeout(deadline, left))
+    {
+        wait = std::chrono::milliseconds::zero();
+    }
+    else if (left != std::chrono::milliseconds::zero())
     {
-        if (m_timer_counter && !in_recovery_thread())
+        wait = std::min(wait, left);
+    }
+
+    const std::shared_ptr<ConcurrencyLimiter> limiter = concurrency_limiter();
+    permit = ConcurrencyLimiter::acquire(limiter, wait);
+    if (!permit)
+    {
+        LOGx3("%s %u requests in flight to %s, over the concurrency limit, reject", traceId.c_str(), limiter->in_flight(), destination().c_str());
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<ConcurrencyLimiter> FuseHttpClient::concurrency_limiter()
+{
+    return m_concurrency_limiter.get([this]() { return ConcurrencyLimiter::of(destination()); });
+}
+
+std::shared_ptr<RetryBudget> FuseHttpClient::hedge_budget()
+{
+    return m_hedge_budget.get([this]() { return RetryBudget::of(destination(), "hedge"); });
+}
+
+std::shared_ptr<WindowedLatencyHistogram> FuseHttpClient::hedge_latency()
+{
+    return m_hedge_latency.get([this]()
         {
-            m_timer_counter->add_count(1);
-            if (m_timer_counter->get_sum_of_last_slices(m_fuse_slide_window) >= m_fuse_threshold)
+            return WindowedLatencyHistogram::of(destination(), std::chrono::seconds(1), hedge_window, "hedge");
+        });
+}
+
+std::chrono::microseconds FuseHttpClient::hedge_delay()
+{
+    const unsigned int delay = m_hedge_delay.load();
+    if (delay != 0)
+    {
+        return std::chrono::milliseconds(delay);
+    }
+
+    m_hedge_p95.update(*hedge_latency(), 95);
+    if (m_hedge_p95.requests() < min_hedge_requests)
+    {
+        return std::chrono::microseconds::zero();
+    }
+    return m_hedge_p95.value();
+}
+
+void FuseHttpClient::rebind_destination()
+{
+    FuseClient::rebind_destination();
+    m_request_stats.reset();
+    m_retry_budget.reset();
+    m_concurrency_limiter.reset();
+    m_hedge_budget.reset();
+    m_hedge_latency.reset();
+}
+
+std::shared_ptr<RetryBudget> FuseHttpClient::retry_budget()
+{
+    return m_retry_budget.get([this]() { return RetryBudget::of(destination()); });
+}
+
+bool FuseHttpClient::record_timings(const std::shared_ptr<HttpClient> &client, const std::string &traceId, bool hedge_sample)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::record_timings"
+
+    HttpTimings timings;
+    client->GetTimings(timings);
+    request_stats()->record(timings);
+    if (m_hedging && hedge_sample)
+    {
+        hedge_latency()->record(timings.phases[HTTP_PHASE_TOTAL]);
+    }
+
+    LOGd5("%s dns: %ldus, connect: %ldus, tls: %ldus, server: %ldus",
+          traceId.c_str(),
+          (long)timings.phases[HTTP_PHASE_DNS].count(),
+          (long)timings.phases[HTTP_PHASE_CONNECT].count(),
+          (long)timings.phases[HTTP_PHASE_TLS].count(),
+          (long)timings.phases[HTTP_PHASE_SERVER].count());
+
+    bool slow = false;
+    for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase)
+    {
+        const unsigned int timeout = m_phase_timeout[phase].load();
+        if (timeout != 0 && timings.phases[phase] > std::chrono::milliseconds(timeout))
+        {
+            LOGx3("%s phase %d took %ldus", traceId.c_str(), phase, (long)timings.phases[phase].count());
+            slow = true;
+        }
+    }
+    return slow;
+}
+
+std::string_view FuseHttpClient::response_body(const std::shared_ptr<HttpClient> &client)
+{
+    const char *body = client->GetResponseBody();
+    return body ? std::string_view(body, client->GetResponseSize()) : std::string_view();
+}
+
+FuseHttpClient::ResponseLease::ResponseLease(ResponseLease &&other)
+{
+    *this = std::move(other);
+}
+
+FuseHttpClient::ResponseLease& FuseHttpClient::ResponseLease::operator=(ResponseLease &&other)
+{
+    if (this != &other)
+    {
+        reset();
+        m_connection_pool = std::move(other.m_connection_pool);
+        m_destination = std::move(other.m_destination);
+        m_client = std::move(other.m_client);
+        other.m_connection_pool.reset();
+    }
+    return *this;
+}
+
+std::string_view FuseHttpClient::ResponseLease::body() const
+{
+    return m_client ? response_body(m_client) : std::string_view();
+}
+
+void FuseHttpClient::ResponseLease::reset()
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::ResponseLease::reset"
+
+    if (m_connection_pool && m_client && !m_connection_pool->release_connection(m_destination, m_client))
+    {
+        LOGx1("fail to release connection of %s", m_destination.c_str());
+    }
+    m_connection_pool.reset();
+    m_client.reset();
+}
+
+bool FuseHttpClient::async_request(const std::string &path,
+                                   HTTP_REQUEST_METHOD method,
+                                   Headers &headers,
+                                   const std::shared_ptr<const Body> &data,
+                                   Completion completion)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::async_request"
+
+    const std::string traceId = prepare_trace_id(headers);
+    const std::shared_ptr<AsyncHttpEngine> engine = m_async_engine;
+    if (!engine || !data)
+    {
+        LOGx1("%s No async engine or body", traceId.c_str());
+        completion(-1, HTTP_UNKNOWN, std::string_view());
+        return false;
+    }
+    if (!fuse_admit(traceId))
+    {
+        completion(-1, HTTP_UNKNOWN, std::string_view());
+        return false;
+    }
+
+    const std::chrono::steady_clock::time_point deadline = request_deadline();
+    std::shared_ptr<ConcurrencyLimiter::Permit> permit = std::make_shared<ConcurrencyLimiter::Permit>();
+    if (!acquire_permit(traceId, deadline, *permit))
+    {
+        completion(-1, HTTP_UNKNOWN, std::string_view());
+        return false;
+    }
+
+    std::shared_ptr<EndpointSet::Lease> endpoint = std::make_shared<EndpointSet::Lease>(pick_endpoint());
+    const std::string pool = pool_destination(*endpoint);
+    std::shared_ptr<ngmp::common::Connection> connection = get_connection(pool, deadline);
+    if (!connection)
+    {
+        LOGx1("%s Not get valid connection from pool", traceId.c_str());
+        completion(-1, HTTP_UNKNOWN, std::string_view());
+        return false;
+    }
+    std::shared_ptr<HttpClient> client = std::dynamic_pointer_cast<HttpClient>(connection);
+    if (*endpoint)
+    {
+        headers[hostName] = destination();
+    }
+
+    std::chrono::milliseconds timeout;
+    if (!attempt_timeout(deadline, timeout))
+    {
+        LOGx2("%s deadline of %ums exceeded while acquiring a connection", traceId.c_str(), m_timeout.load());
+        m_connection_pool->release_connection(pool, connection);
+        completion(-1, HTTP_DEADLINE_EXCEEDED, std::string_view());
+        return false;
+    }
+
+    const std::string URI = "http://" + pool + path;
+    client->SetHeaderTemplate(std::atomic_load(&m_header_template));
+    data->prepare(client, traceId, URI, method, timeout, headers);
+    client->SetConnectTimeout(connect_timeout(timeout));
+    LOGd3("%s Do async request: %s %s", traceId.c_str(), HttpClient::methodName(method).c_str(), URI.c_str());
+
+    {
+        std::lock_guard<std::mutex> lock(m_async_mtx);
+        ++m_async_pending;
+    }
+    if (m_http2)
+    {
+        client->SetHttp2(m_http2_prior_knowledge);
+    }
+    const std::chrono::time_point<std::chrono::steady_clock> startTime = std::chrono::steady_clock::now();
+    const bool submitted = engine->submit(client,
+        [this, traceId, URI, data, pool, endpoint, connection, client, startTime, permit, completion](CURLcode result)
+        {
+            long code = 0;
+            const HTTP_ERROR_CODE err = client->FinishRequest(result, code);
+            const std::string_view body = response_body(client);
+            std::chrono::time_point<std::chrono::steady_clock> endTime = std::chrono::steady_clock::now();
+            auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+            const bool slow_phase = record_timings(client, traceId);
+            fuse_report_latency(traceId, std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime));
+
+            if (err == HTTP_SUCCESS)
+            {
+                LOGd5("%s request URL: %s, response: %ld %s, latency: %ldms", traceId.c_str(), URI.c_str(), code, body.data(), latency);
+                retry_budget()->on_success();
+            }
+            else
+            {
+                LOGx4("%s request URL: %s, response: %s, latency: %ldms",
+                        traceId.c_str(), URI.c_str(), std::to_string(code).append(" ").append(body).c_str(), latency);
+            }
+
+            if (is_failure(err, latency, slow_phase))
+            {
+                fuse_report_failure(traceId);
+            }
+            else
             {
-                bool expected = false;
-                if (m_in_fuse_mode.compare_exchange_strong(expected, true))
+                fuse_report_success();
+            }
+            if (endpoint->release(!is_failure(err, latency, slow_phase)))
+            {
+                LOGx2("%s endpoint %s ejected after consecutive failures", traceId.c_str(), pool.c_str());
+            }
+            permit->release(std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime), is_dropped(err));
+
+            //the body is read in place, the connection goes back to the pool afterwards
+            completion(code, err, body);
+
+            if (err == HTTP_NETWORK_ERROR || err == HTTP_TIMEOUT || result == CURLE_ABORTED_BY_CALLBACK)
+            {
+                m_connection_pool->discard_connection(pool, connection);
+            }
+            else if (!m_connection_pool->release_connection(pool, connection))
+            {
+                LOGx1("%s fail to release connection", traceId.c_str());
+            }
+            finish_async();
+        });
+    if (!submitted)
+    {
+        LOGx1("%s fail to submit async request", traceId.c_str());
+        long code = 0;
+        client->FinishRequest(CURLE_FAILED_INIT, code);
+        m_connection_pool->release_connection(pool, connection);
+        finish_async();
+        completion(-1, HTTP_UNKNOWN, std::string_view());
+        return false;
+    }
+    return true;
+}
+
+std::future<FuseHttpClient::AsyncResponse> FuseHttpClient::async_request(const std::string &path,
+                                                                         HTTP_REQUEST_METHOD method,
+                                                                         Headers &headers,
+                                                                         const std::shared_ptr<const Body> &data)
+{
+    std::shared_ptr<std::promise<AsyncResponse>> promise = std::make_shared<std::promise<AsyncResponse>>();
+    std::future<AsyncResponse> future = promise->get_future();
+    async_request(path, method, headers, data,
+        [promise](long code, HTTP_ERROR_CODE err, std::string_view response)
+        {
+            promise->set_value(AsyncResponse{code, err, std::string(response)});
+        });
+    return future;
+}
+
+HTTP_ERROR_CODE FuseHttpClient::send_request(const std::shared_ptr<HttpClient> &client, long &code, bool streamed)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::send_request"
+
+    const std::shared_ptr<AsyncHttpEngine> engine = m_async_engine;
+    if (!m_http2 || !engine)
+    {
+        return client->SendRequest(code);
+    }
+    if (streamed)
+    {
+        //a slow sink on the event loop would stall every other transfer, stream on the connection of the handle
+        client->SetHttp2(m_http2_prior_knowledge);
+        return client->SendRequest(code);
+    }
+
+    //block on the engine, the transfer becomes a stream on a shared connection
+    client->SetHttp2(m_http2_prior_knowledge);
+    std::shared_ptr<std::promise<CURLcode>> done = std::make_shared<std::promise<CURLcode>>();
+    std::future<CURLcode> result = done->get_future();
+    if (!engine->submit(client, [done](CURLcode res) { done->set_value(res); }))
+    {
+        //the engine is not started or stopping, not a failure of the destination
+        LOGd1("engine refuses the transfer to %s, send it blocking", destination().c_str());
+        return client->SendRequest(code);
+    }
+    return client->FinishRequest(result.get(), code);
+}
+
+struct FuseHttpClient::HedgeRace
+{
+    std::mutex mtx;
+    std::condition_variable condition;
+    EndpointSet::Lease endpoints[2];
+    std::string pools[2];
+    std::shared_ptr<ngmp::common::Connection> connections[2];
+    std::shared_ptr<HttpClient> clients[2];
+    uint64_t transfers[2] = {0, 0};     // ids on the engine, to cancel the loser
+    std::chrono::steady_clock::time_point submitted[2];
+    std::chrono::steady_clock::time_point finished[2];  // completed, or aborted when canceled
+    HTTP_ERROR_CODE errors[2] = {HTTP_UNKNOWN, HTTP_UNKNOWN};
+    long codes[2] = {0, 0};
+    bool done[2] = {false, false};
+    int launched = 0;
+    int first = -1;     // attempt completed first
+};
+
+HTTP_ERROR_CODE FuseHttpClient::send_hedged(const std::string &traceId,
+                                            const PrepareAttempt &prepare,
+                                            std::chrono::steady_clock::time_point deadline,
+                                            EndpointSet::Lease &endpoint,
+                                            std::string &pool,
+                                            std::shared_ptr<ngmp::common::Connection> &connection,
+                                            std::shared_ptr<HttpClient> &client,
+                                            long &code)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::send_hedged"
+
+    const std::shared_ptr<AsyncHttpEngine> engine = m_async_engine;
+    const std::shared_ptr<HedgeRace> race = std::make_shared<HedgeRace>();
+    race->endpoints[0] = std::move(endpoint);
+    race->pools[0] = pool;
+    race->connections[0] = connection;
+    race->clients[0] = client;
+    const auto submit = [this, &engine, &race](int i)
+    {
+        const std::shared_ptr<HttpClient> attempt = race->clients[i];
+        if (m_http2)
+        {
+            attempt->SetHttp2(m_http2_prior_knowledge);
+        }
+        //the result is read on the event loop, the caller only picks the winner
+        race->submitted[i] = std::chrono::steady_clock::now();
+        race->transfers[i] = engine->submit(attempt, [race, attempt, i](CURLcode result)
+            {
+                long code = 0;
+                const HTTP_ERROR_CODE err = attempt->FinishRequest(result, code);
+                const std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> lock(race->mtx);
+                race->finished[i] = finished;
+                race->errors[i] = err;
+                race->codes[i] = code;
+                race->done[i] = true;
+                race->first = race->first < 0 ? i : race->first;
+                race->condition.notify_all();
+            });
+        return race->transfers[i] != 0;
+    };
+    race->launched = 1;
+    if (!submit(0))
+    {
+        LOGd2("%s engine refuses the transfer to %s, send it blocking", traceId.c_str(), destination().c_str());
+        endpoint = std::move(race->endpoints[0]);
+        return client->SendRequest(code);
+    }
+
+    std::unique_lock<std::mutex> lock(race->mtx);
+    const std::chrono::microseconds delay = hedge_delay();
+    const std::chrono::steady_clock::time_point hedge_at = std::chrono::steady_clock::now() + delay;
+    if (delay != std::chrono::microseconds::zero() && hedge_at < deadline &&
+        !race->condition.wait_until(lock, hedge_at, [&race]() { return race->done[0]; }))
+    {
+        lock.unlock();
+        std::chrono::milliseconds timeout;
+        if (!hedge_budget()->try_retry())
+        {
+            LOGd2("%s hedge budget of %s spent, no hedge", traceId.c_str(), destination().c_str());
+        }
+        else if (attempt_timeout(deadline, timeout))
+        {
+            //a hedge never waits for the pool, the attempt it races is already late
+            EndpointSet::Lease hedge_endpoint = pick_endpoint(race->endpoints[0].endpoint());
+            const std::string hedge_pool = pool_destination(hedge_endpoint);
+            const std::shared_ptr<ngmp::common::Connection> hedge =
+                m_connection_pool->get_connection(hedge_pool, std::chrono::milliseconds::zero());
+            if (!hedge)
+            {
+                LOGd2("%s no connection left for a hedge to %s", traceId.c_str(), hedge_pool.c_str());
+            }
+            else
+            {
+                race->endpoints[1] = std::move(hedge_endpoint);
+                race->pools[1] = hedge_pool;
+                race->connections[1] = hedge;
+                race->clients[1] = std::dynamic_pointer_cast<HttpClient>(hedge);
+                prepare(race->clients[1], hedge_pool, timeout);
+                LOGd3("%s no response after %ldus, hedge to %s", traceId.c_str(), (long)delay.count(), hedge_pool.c_str());
+                if (submit(1))
                 {
-                    LOGx3("%s %u  errors in %u seconds, enter fuse mode", traceId.c_str(), m_fuse_threshold, m_fuse_slide_window);
-                    if (!m_recovery_triggered)
-                    {
-                        m_recovery_triggered = std::make_shared<std::atomic<bool>>(false);
-                    }
-                    if (m_recovery_triggered->compare_exchange_strong(expected, true))
-                    {
-                        if (m_recovery_thread.joinable())
-                        {
-                            m_recovery_thread.join();
-                        }
-                        m_recovery_thread = std::thread(&FuseHttpClient::recovery_func, this);
-                    }
+                    race->launched = 2;
+                }
+                else
+                {
+                    long ignored = 0;
+                    race->clients[1]->FinishRequest(CURLE_FAILED_INIT, ignored);
+                    m_connection_pool->release_connection(hedge_pool, hedge);
+                    race->endpoints[1] = EndpointSet::Lease();
+                    race->connections[1].reset();
+                    race->clients[1].reset();
                 }
             }
         }
+        lock.lock();
     }
 
-    return code;
+    //the first response wins, a failed attempt waits for the other one still running
+    int winner = -1;
+    race->condition.wait(lock, [&race, &winner]()
+    {
+        for (int i = 0; i < race->launched; ++i)
+        {
+            if (race->done[i] && (race->errors[i] == HTTP_SUCCESS || race->errors[i] == HTTP_CLIENT_ERROR) &&
+                (winner < 0 || race->first == i))
+            {
+                winner = i;
+            }
+        }
+        if (winner < 0 && std::count(race->done, race->done + race->launched, true) == race->launched)
+        {
+            winner = race->first;
+        }
+        return winner >= 0;
+    });
+
+    const int loser = 1 - winner;
+    if (race->clients[loser])
+    {
+        bool canceled = false;
+        if (!race->done[loser])
+        {
+            lock.unlock();
+            engine->cancel(race->clients[loser], race->transfers[loser]);
+            lock.lock();
+            race->condition.wait(lock, [&race, loser]() { return race->done[loser]; });
+            canceled = true;
+        }
+        const bool answered = race->errors[loser] == HTTP_SUCCESS || race->errors[loser] == HTTP_CLIENT_ERROR;
+        if (answered)
+        {
+            m_connection_pool->release_connection(race->pools[loser], race->connections[loser]);
+        }
+        else
+        {
+            //canceled in the middle of the transfer, or failed, the socket cannot be reused
+            m_connection_pool->discard_connection(race->pools[loser], race->connections[loser]);
+        }
+        if (!canceled)
+        {
+            //a replica which lost the race is only slower, a failure still counts against it
+            race->endpoints[loser].release(answered);
+        }
+        race->endpoints[loser] = EndpointSet::Lease();
+        if (winner == 1)
+        {
+            LOGd1("%s the hedge won", traceId.c_str());
+        }
+    }
+
+    //the first attempt whether it won or not, the winners alone would pull the p95, hence the delay, down
+    if (m_hedging)
+    {
+        hedge_latency()->record(std::chrono::duration_cast<std::chrono::microseconds>(race->finished[0] - race->submitted[0]));
+    }
+
+    endpoint = std::move(race->endpoints[winner]);
+    pool = race->pools[winner];
+    connection = race->connections[winner];
+    client = race->clients[winner];
+    code = race->codes[winner];
+    return race->errors[winner];
+}
+
+void FuseHttpClient::finish_async()
+{
+    std::lock_guard<std::mutex> lock(m_async_mtx);
+    --m_async_pending;
+    m_async_condition.notify_all();
+}
+
+std::string FuseHttpClient::prepare_trace_id(Headers &headers)
+{
+#undef __FUNC__
+#define __FUNC__ "FuseHttpClient::prepare_trace_id"
+
+    std::string traceId;
+    Headers::const_iterator iter = headers.find(traceIdName);
+    if (iter != headers.cend())
+    {
+        traceId = iter->second;
+    }
+    else
+    {
+        GenUUID(traceId);
+        headers[traceIdName] = traceId;
+        LOGd1("%s Without trace-id", traceId.c_str());
+    }
+    headers[albTraceIdName] = "Root=" + traceId;
+    return traceId;
 }
 
 void FuseHttpClient::JsonBody::prepare(const std::shared_ptr<HttpClient> &client,
                                        const std::string &traceId,
                                        const std::string &URI,
                                        HTTP_REQUEST_METHOD method,
-                                       unsigned int timeout,
+                                       std::chrono::milliseconds timeout,
                                        Headers &headers) const
 {
 #undef __FUNC__
@@ -174,7 +886,7 @@ void FuseHttpClient::MultiPartBody::prepare(const std::shared_ptr<HttpClient> &c
                                             const std::string &traceId,
                                             const std::string &URI,
                                             HTTP_REQUEST_METHOD method,
-                                            unsigned int timeout,
+                                            std::chrono::milliseconds timeout,
                                             Headers &headers) const
 {
 #undef __FUNC__
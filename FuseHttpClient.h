@@ -3,10 +3,20 @@
 
 #include "FuseBaseClient.h"
 #include "HttpConnection.h"
+#include "AsyncHttpEngine.h"
+#include "RequestStats.h"
+#include "RetryPolicy.h"
+#include "./Util/ConcurrencyLimiter.h"
 #include "LocalUtility.h"
 #include <string>
+#include <string_view>
 #include <memory>
 #include <map>
+#include <chrono>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <condition_variable>
 
 class FuseHttpClient : public FuseClient
 {
@@ -21,7 +31,7 @@ public:
                              const std::string &traceId,
                              const std::string &URI,
                              HTTP_REQUEST_METHOD method,
-                             unsigned int timeout,
+                             std::chrono::milliseconds timeout,
                              Headers &headers) const = 0;
     };
 
@@ -36,7 +46,7 @@ public:
                      const std::string &traceId,
                      const std::string &URI,
                      HTTP_REQUEST_METHOD method,
-                     unsigned int timeout,
+                     std::chrono::milliseconds timeout,
                      Headers &headers) const;
     private:
         std::string m_data;
@@ -71,31 +81,290 @@ public:
                      const std::string &traceId,
                      const std::string &URI,
                      HTTP_REQUEST_METHOD method,
-                     unsigned int timeout,
+                     std::chrono::milliseconds timeout,
                      Headers &headers) const;
     private:
         std::vector<FormData> m_data;
     };
 
+    struct AsyncResponse
+    {
+        long code;
+        HTTP_ERROR_CODE err;
+        std::string response;
+    };
+
+    using ResponseSink = HttpConnection::ResponseSink;
+
+    // Called on the event loop thread of the engine, must not block. The
+    // response points into the connection buffer and is valid during the call only.
+    using Completion = std::function<void(long code, HTTP_ERROR_CODE err, std::string_view response)>;
+
+    /*
+     * Body of a do_request read in place from the buffer of the connection.
+     * The connection is kept out of the pool until the lease is reset or
+     * destroyed, so do not hold it longer than needed to parse the body.
+    */
+    class ResponseLease
+    {
+    public:
+        ResponseLease() = default;
+        ~ResponseLease()
+        {
+            reset();
+        }
+
+        ResponseLease(ResponseLease &&other);
+        ResponseLease& operator=(ResponseLease &&other);
+
+        ResponseLease(const ResponseLease&) = delete;
+        ResponseLease& operator=(const ResponseLease&) = delete;
+
+        std::string_view body() const;
+
+        // give the connection back to the pool, body() is empty afterwards
+        void reset();
+
+    private:
+        friend class FuseHttpClient;
+
+        std::shared_ptr<ngmp::common::ConnectionPool> m_connection_pool; // null when the connection is not reused
+        std::string m_destination;
+        std::shared_ptr<HttpClient> m_client;
+    };
+
     FuseHttpClient(const std::string &host = "", unsigned int port = 80);
     virtual ~FuseHttpClient();
 
     FuseHttpClient(const FuseHttpClient&) = delete;
     FuseHttpClient& operator=(const FuseHttpClient&) = delete;
 
+    void set_async_engine(const std::shared_ptr<AsyncHttpEngine> &async_engine)
+    {
+        m_async_engine = async_engine;
+    }
+
+    // Rendered once and sent with every request, a header passed to a request
+    // with the same key wins. Only the per-request headers (trace ids, content
+    // type) are rendered per request, into buffers reused by the connection.
+    void set_static_headers(const Headers &headers)
+    {
+        std::atomic_store(&m_header_template, std::make_shared<const HeaderTemplate>(headers));
+    }
+
+    // Phase timings of the requests of every client of this destination,
+    // bound to the destination at the first call
+    std::shared_ptr<RequestStats> request_stats();
+
+    // A request whose phase takes longer than timeout (millisecond) counts as
+    // a failure for the fuse, e.g. slow connects with a healthy server. 0: off
+    void set_phase_timeout(HTTP_REQUEST_PHASE phase, unsigned int timeout)
+    {
+        m_phase_timeout[phase] = timeout;
+    }
+
+    // Decides which failed attempts are retried in place and the backoff before each,
+    // ExponentialBackoffRetry by default. The number of retries is set_inplace_retry_times
+    void set_retry_policy(const std::shared_ptr<const RetryPolicy> &retry_policy)
+    {
+        std::atomic_store(&m_retry_policy, retry_policy);
+    }
+
+    // Bounds the retries of every client of this destination to a ratio of its
+    // successful requests, bound to the destination at the first call
+    std::shared_ptr<RetryBudget> retry_budget();
+
+    /*
+     * Bound the requests in flight to this destination by the adaptive limit
+     * of concurrency_limiter(), before a connection is taken from the pool.
+     * A request over the limit waits up to max_wait, within its deadline,
+     * then is rejected without being sent. Rejections do not count for the fuse.
+    */
+    void set_concurrency_limit(bool enabled, std::chrono::milliseconds max_wait = std::chrono::milliseconds(0))
+    {
+        m_concurrency_wait = max_wait.count();
+        m_concurrency_limit = enabled;
+    }
+
+    // Shared by every client of this destination, bound at the first call
+    std::shared_ptr<ConcurrencyLimiter> concurrency_limiter();
+
+    /*
+     * Hedge GET lookups: when an attempt has not completed after delay, the
+     * same request is sent on another pooled connection, the first response
+     * wins and the other transfer is canceled. delay 0 follows the p95 of
+     * the destination over the last hedge_window seconds. Hedges are bounded by
+     * hedge_budget() and a hedged request counts once for the fuse.
+     * Needs an async engine, streamed requests are never hedged.
+    */
+    void set_hedging(bool enabled, std::chrono::milliseconds delay = std::chrono::milliseconds(0))
+    {
+        m_hedge_delay = delay.count();
+        m_hedging = enabled;
+    }
+
+    // Bounds the hedges of every client of this destination to a ratio of its
+    // successful GETs, bound to the destination at the first call
+    std::shared_ptr<RetryBudget> hedge_budget();
+
+    // Latency of the first attempts of every client of this destination over
+    // the last hedge_window seconds, bound to the destination at the first call
+    std::shared_ptr<WindowedLatencyHistogram> hedge_latency();
+
+    // Needs an async engine with multiplexing, do_request then runs on the engine
+    // so that concurrent requests to the destination share connections as streams
+    void set_http2(bool http2, bool prior_knowledge = true)
+    {
+        m_http2_prior_knowledge = prior_knowledge;
+        m_http2 = http2;
+    }
+
 private:
     virtual bool test()
     {
         return true;
     }
 
+    static std::string prepare_trace_id(Headers &headers);
+
+    // timeout of the next attempt from what is left of deadline, 0 without a deadline.
+    // false when nothing is left
+    static bool attempt_timeout(std::chrono::steady_clock::time_point deadline, std::chrono::milliseconds &timeout);
+
+    std::chrono::milliseconds connect_timeout(std::chrono::milliseconds timeout) const;
+
+    // false when the request is over the concurrency limit and must be rejected
+    bool acquire_permit(const std::string &traceId,
+                        std::chrono::steady_clock::time_point deadline,
+                        ConcurrencyLimiter::Permit &permit);
+
+    // failures telling the backend is overloaded, the concurrency limit backs off on them
+    static bool is_dropped(HTTP_ERROR_CODE err)
+    {
+        return err == HTTP_TIMEOUT || err == HTTP_NETWORK_ERROR || err == HTTP_SERVER_ERROR;
+    }
+
+    static std::string_view response_body(const std::shared_ptr<HttpClient> &client);
+
+    long perform_request(const std::string &path,
+                         HTTP_REQUEST_METHOD method,
+                         Headers &headers,
+                         const Body &data,
+                         ResponseLease &response,
+                         const ResponseSink *sink);
+
+    bool is_failure(HTTP_ERROR_CODE err, int64_t latency, bool slow_phase) const
+    {
+        return (err != HTTP_SUCCESS && err != HTTP_CLIENT_ERROR) || latency > m_latency_timeout || slow_phase;
+    }
+
+    // record the timings of the request just finished on client, true when a phase exceeded its timeout.
+    // hedge_sample: also into hedge_latency(), a hedged request records its first attempt itself
+    bool record_timings(const std::shared_ptr<HttpClient> &client, const std::string &traceId, bool hedge_sample = true);
+
+    void finish_async();
+
+    // streamed: the response goes to a sink, which must run on the calling thread, never on the event loop
+    HTTP_ERROR_CODE send_request(const std::shared_ptr<HttpClient> &client, long &code, bool streamed);
+
+    // address: endpoint or destination() the attempt is sent to
+    using PrepareAttempt = std::function<void(const std::shared_ptr<HttpClient> &client,
+                                              const std::string &address,
+                                              std::chrono::milliseconds timeout)>;
+
+    // send the request prepared on client, hedged on a second connection, to another endpoint if
+    // any, prepared by prepare if it is late. endpoint, pool, connection and client are those of
+    // the winner afterwards
+    HTTP_ERROR_CODE send_hedged(const std::string &traceId,
+                                const PrepareAttempt &prepare,
+                                std::chrono::steady_clock::time_point deadline,
+                                EndpointSet::Lease &endpoint,
+                                std::string &pool,
+                                std::shared_ptr<ngmp::common::Connection> &connection,
+                                std::shared_ptr<HttpClient> &client,
+                                long &code);
+
+    // zero while the destination has too few requests for a p95
+    std::chrono::microseconds hedge_delay();
+
+    struct HedgeRace;
+
+    static constexpr uint64_t min_hedge_requests = 100;
+    static constexpr unsigned int hedge_window = 60;   // unit: second
+
 protected:
+    void rebind_destination() override;
+
     long do_request(const std::string &path,
                     HTTP_REQUEST_METHOD method,
                     Headers &headers,
                     const Body &data,
                     std::string &response);
 
+    // Same as above without copying the body out of the connection
+    long do_request(const std::string &path,
+                    HTTP_REQUEST_METHOD method,
+                    Headers &headers,
+                    const Body &data,
+                    ResponseLease &response);
+
+    /*
+     * Stream the body to sink chunk by chunk as it arrives, so it can be
+     * parsed with bounded memory. Fuse accounting, latency and connection
+     * release are the same as above. Returning false from the sink aborts
+     * the transfer, reported as a client error. A failed attempt is only
+     * retried when nothing was streamed yet. The sink runs on the calling
+     * thread, also with set_http2, which then skips the async engine.
+    */
+    long do_request(const std::string &path,
+                    HTTP_REQUEST_METHOD method,
+                    Headers &headers,
+                    const Body &data,
+                    const ResponseSink &sink);
+
+    /*
+     * Same fuse checks and trace-id handling as do_request, but the transfer
+     * runs on the async engine and completion is called when it is done.
+     * The body is kept alive until then. No in-place retry is done.
+     * The response given to completion is a view into the connection, which
+     * goes back to the pool once completion returns: a slow completion holds
+     * the pooled connection and the event loop. Returns false when the request was not sent, completion has been
+     * called already in that case.
+    */
+    bool async_request(const std::string &path,
+                       HTTP_REQUEST_METHOD method,
+                       Headers &headers,
+                       const std::shared_ptr<const Body> &data,
+                       Completion completion);
+
+    std::future<AsyncResponse> async_request(const std::string &path,
+                                             HTTP_REQUEST_METHOD method,
+                                             Headers &headers,
+                                             const std::shared_ptr<const Body> &data);
+
+private:
+    std::shared_ptr<AsyncHttpEngine> m_async_engine;
+    std::shared_ptr<const HeaderTemplate> m_header_template;
+    std::atomic<bool> m_http2{false};
+    std::atomic<bool> m_http2_prior_knowledge{true};
+    DestinationBinding<RequestStats> m_request_stats;
+    std::shared_ptr<const RetryPolicy> m_retry_policy;
+    DestinationBinding<RetryBudget> m_retry_budget;
+    DestinationBinding<ConcurrencyLimiter> m_concurrency_limiter;
+    std::atomic<bool> m_concurrency_limit{false};
+    std::atomic<unsigned int> m_concurrency_wait{0}; // unit: millisecond
+    DestinationBinding<RetryBudget> m_hedge_budget;
+    DestinationBinding<WindowedLatencyHistogram> m_hedge_latency;
+    std::atomic<bool> m_hedging{false};
+    std::atomic<unsigned int> m_hedge_delay{0};       // unit: millisecond, 0: p95
+    CachedPercentile m_hedge_p95;
+    std::atomic<unsigned int> m_phase_timeout[HTTP_PHASE_COUNT] = {}; // unit: millisecond
+
+    // the destructor waits for the async requests still in flight
+    std::mutex m_async_mtx;
+    std::condition_variable m_async_condition;
+    unsigned int m_async_pending = 0;
+
 
 public:
     static const std::string traceIdName;
@@ -103,6 +372,7 @@ public:
     static const std::string contentType;
     static const std::string multiPartFormData;
     static const std::string jsonData;
+    static const std::string hostName;
 };
 
 #endif // _FUSEHTTPCLIENT_H
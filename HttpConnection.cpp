@@ -1,14 +1,17 @@
 #include "HttpConnection.h"
 #include "LocalUtility.h"
 
+#include <deque>
 #include <mutex>
+#include <vector>
+#include <algorithm>
 
 
 class HttpConnectionImpl
 {
 public:
-    HttpConnectionImpl(bool verify_peer, bool verify_host) : curl(0), headers(NULL), response_body(),
-        ssl_verify_peer(verify_peer), ssl_verify_host(verify_host)
+    HttpConnectionImpl(bool verify_peer, bool verify_host, bool share_cache) : curl(0), headers(NULL), response_body(),
+        ssl_verify_peer(verify_peer), ssl_verify_host(verify_host), share_cache(share_cache)
     {
     }
 
@@ -16,28 +19,50 @@ public:
     {
         static std::once_flag init_flag;
         CURLcode ret = CURL_LAST;
-        std::call_once(init_flag, [&ret](){ ret = curl_global_init(CURL_GLOBAL_ALL); });
+        std::call_once(init_flag, [&ret]()
+        {
+            ret = curl_global_init(CURL_GLOBAL_ALL);
+            if (ret == CURLE_OK)
+                share = CreateShare();
+        });
         return ret == CURLE_OK;
     }
 
     static void HTTPS_GLOBAL_FINALIZE()
     {
+#undef  __FUNC__
+#define __FUNC__ "HttpConnectionImpl::HTTPS_GLOBAL_FINALIZE"
+
+        if (share)
+        {
+            //fails while an easy handle still uses the share, it is leaked then rather than freed under the handle
+            CURLSHcode sc = curl_share_cleanup(share);
+            if (sc != CURLSHE_OK)
+                LOGx2("curl_share_cleanup() failed, %d: %s", sc, curl_share_strerror(sc));
+            share = NULL;
+        }
         curl_global_cleanup();
     }
 
     bool Initialize()
     {
+#undef  __FUNC__
+#define __FUNC__ "HttpConnectionImpl::Initialize"
+
         curl = curl_easy_init();
+        if (curl && share_cache)
+        {
+            if (share)
+                curl_easy_setopt(curl, CURLOPT_SHARE, share);
+            else
+                LOGx1("shared cache requested before %s, the connection uses its own caches", "HTTPS_GLOBAL_INITIALIZE");
+        }
         return curl != 0;
     }
 
     bool Finalize()
     {
-        if (response_body.memory)
-        {
-            free(response_body.memory);
-            response_body.memory = NULL;
-        }
+        response_body.release();
 
         if (curl)
         {
@@ -64,7 +89,7 @@ public:
     }
 
     void SetOptions(const char* url, HTTP_REQUEST_METHOD method,
-        std::map<std::string, std::string>& http_headers, unsigned int timeout)
+        std::map<std::string, std::string>& http_headers, std::chrono::milliseconds timeout)
     {
 #undef  __FUNC__
 #define __FUNC__ "HttpConnectionImpl::SetOptions"
@@ -72,6 +97,7 @@ public:
         //Disable proxy, if need proxy, set in another function
         curl_easy_setopt(curl, CURLOPT_PROXY, "");
         curl_easy_setopt(curl, CURLOPT_URL, url);
+        ResetHttpVersion();
 
         if (method == HTTP_GET)
             curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
@@ -88,16 +114,10 @@ public:
             curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
 
         //Default timeout is 0 (zero) which means it never times out during transfer.
-        //unit is second,  for whole request
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+        //for whole request
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout.count());
 
-        for (std::map<std::string, std::string>::const_iterator iter = http_headers.begin();
-            iter != http_headers.end(); iter++)
-        {
-            std::string header = iter->first + ": " + iter->second;
-            LOGd1("\t%s", header.c_str());
-            headers = curl_slist_append(headers, header.c_str());
-        }
+        BuildHeaders(http_headers);
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
         //set to 1 tells the library to fail the request if the HTTP code returned is equal to or larger than 400
@@ -113,15 +133,64 @@ public:
         //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
         //to get the response body
-        if (response_body.memory)
-            free(response_body.memory);
-        response_body.memory = (char*)malloc(1);  /* will be grown as needed by the realloc */
-        response_body.size = 0;    /* no data at this point */
-        response_body.memory[0] = '\0';
+        response_body.reset(curl);    /* capacity is kept for the next response */
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response_body);
     }
 
+    bool WarmUp(const std::string &url)
+    {
+#undef  __FUNC__
+#define __FUNC__ "HttpConnectionImpl::WarmUp"
+
+        //A HEAD request opens the connection (TCP and TLS) and leaves it in the connection cache of the handle,
+        //the status code does not matter
+        curl_easy_setopt(curl, CURLOPT_PROXY, "");
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        //an unreachable destination must not hold the warm-up worker, give up on the connect early
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, warm_up_connect_timeout);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, warm_up_timeout);
+        if (!ssl_verify_peer)
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        if (!ssl_verify_host)
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+
+        CURLcode res = curl_easy_perform(curl);
+
+        //back to a plain GET, the next request sets its own options
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 0L);
+        if (res != CURLE_OK)
+        {
+            LOGx3("warm up %s failed, %d: %s", url.c_str(), res, curl_easy_strerror(res));
+            return false;
+        }
+        return true;
+    }
+
+    void SetConnectTimeout(std::chrono::milliseconds timeout)
+    {
+        //the handle is reused, 0 puts back the default of curl
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)timeout.count());
+    }
+
+    //the handle is pooled, a request which does not call SetHttp2 must not inherit
+    //the HTTP/2 settings of the previous one
+    void ResetHttpVersion()
+    {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_NONE);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+    }
+
+    void SetHttp2(bool prior_knowledge)
+    {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, prior_knowledge ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+
     void PreparePostData(const char* data, unsigned long size)
     {
         /* size of the POST data */
@@ -141,14 +210,33 @@ public:
     }
 
     HTTP_ERROR_CODE SendRequest(long &response_code)
+    {
+        return FinishRequest(curl_easy_perform(curl), response_code);
+    }
+
+    CURL* Handle()
+    {
+        return curl;
+    }
+
+    //res is the result of the transfer, by curl_easy_perform or a curl_multi event loop
+    HTTP_ERROR_CODE FinishRequest(CURLcode res, long &response_code)
     {
 #undef  __FUNC__
-#define __FUNC__ "HttpConnectionImpl::SendRequest"
+#define __FUNC__ "HttpConnectionImpl::FinishRequest"
         response_code = 0;
 
-        CURLcode res = curl_easy_perform(curl);
-        curl_slist_free_all(headers);
+        if (response_sink)
+        {
+            //the next request buffers its body again unless it sets a sink of its own
+            response_sink = nullptr;
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response_body);
+        }
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
         headers = NULL;
+        header_list.clear();
+        header_template.reset();
         curl_formfree(formpost);
         formpost = lastptr = nullptr;
         if (res != CURLE_OK)
@@ -159,6 +247,8 @@ public:
                 return HTTP_NETWORK_ERROR;
             else if (res == CURLE_OPERATION_TIMEDOUT)
                 return HTTP_TIMEOUT;
+            else if (res == CURLE_WRITE_ERROR) //aborted by the response sink or out of memory, not a server failure
+                return HTTP_CLIENT_ERROR;
             else
             {
                 res = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
@@ -193,6 +283,51 @@ public:
         }
     }
 
+    size_t GetResponseSize()
+    {
+        return response_body.size;
+    }
+
+    void GetTimings(HttpTimings &timings)
+    {
+        //points in time since the start of the request, zero for a step that did not happen
+        curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+        timings.phases[HTTP_PHASE_DNS] = Span(0, namelookup);
+        timings.phases[HTTP_PHASE_CONNECT] = Span(namelookup, connect);
+        timings.phases[HTTP_PHASE_TLS] = appconnect ? Span(connect, appconnect) : std::chrono::microseconds(0);
+        timings.phases[HTTP_PHASE_SERVER] = starttransfer ? Span(pretransfer, starttransfer) : std::chrono::microseconds(0);
+        timings.phases[HTTP_PHASE_TRANSFER] = starttransfer ? Span(starttransfer, total) : std::chrono::microseconds(0);
+        timings.phases[HTTP_PHASE_TOTAL] = Span(0, total);
+
+        timings.uploaded = timings.downloaded = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &timings.uploaded);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &timings.downloaded);
+    }
+
+    void SetHeaderTemplate(const std::shared_ptr<const HeaderTemplate> &header_template)
+    {
+        this->header_template = header_template;
+    }
+
+    void SetResponseSink(HttpConnection::ResponseSink sink)
+    {
+        response_sink = std::move(sink);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteSinkCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response_sink);
+    }
+
+    void ReserveResponse(size_t size)
+    {
+        response_body.reserve(size + 1);
+    }
+
     char* GetResponseBody()
     {
         if (response_body.memory)
@@ -213,26 +348,18 @@ public:
               CURLFORM_END);
     }
 
-    void SetMultiPartOptions(const char* url, std::map<std::string, std::string>& http_headers, unsigned int timeout)
+    void SetMultiPartOptions(const char* url, std::map<std::string, std::string>& http_headers, std::chrono::milliseconds timeout)
     {
         curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);        
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-        for (std::map<std::string, std::string>::const_iterator iter = http_headers.begin();
-            iter != http_headers.end(); iter++)
-        {
-            std::string header = iter->first + ": " + iter->second;
-            headers = curl_slist_append(headers, header.c_str());
-        }
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout.count());
+        BuildHeaders(http_headers);
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_URL, url);
+        ResetHttpVersion();
         curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
 
         //To get the response
-        if (response_body.memory)
-            free(response_body.memory);
-        response_body.memory = (char*)malloc(1);  /* will be grown as needed by the realloc */
-        response_body.size = 0;    /* no data at this point */
-        response_body.memory[0] = '\0';
+        response_body.reset(curl);    /* capacity is kept for the next response */
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response_body);
 
@@ -243,16 +370,169 @@ private:
     CURL* curl;
     struct curl_httppost * formpost = NULL;
     struct curl_httppost * lastptr = NULL;
-    struct curl_slist *headers;
+    struct curl_slist *headers;    /* points into header_list, never freed by curl_slist_free_all */
+
+    //curl_slist nodes and header lines owned by the connection and reused across requests,
+    //so building the headers of a request does not allocate once the capacity is reached
+    struct HeaderList
+    {
+        std::vector<curl_slist> nodes;
+        std::deque<std::string> lines;  //a deque, growing must not move the lines the nodes point to
+        size_t node_count = 0;
+        size_t line_count = 0;
+
+        //line must outlive the request
+        void append_line(const char *line)
+        {
+            if (node_count == nodes.size())
+                nodes.emplace_back();
+            nodes[node_count].data = const_cast<char*>(line);
+            ++node_count;
+        }
+
+        void append(const std::string &key, const std::string &value)
+        {
+            if (line_count == lines.size())
+                lines.emplace_back();
+            std::string &line = lines[line_count++];
+            line.assign(key).append(": ").append(value);
+            append_line(line.c_str());
+        }
+
+        //link the nodes once all are appended, appending may move them
+        curl_slist* head()
+        {
+            for (size_t i = 0; i < node_count; ++i)
+                nodes[i].next = i + 1 < node_count ? &nodes[i + 1] : NULL;
+            return node_count ? &nodes[0] : NULL;
+        }
+
+        void clear()
+        {
+            node_count = line_count = 0;
+        }
+    };
+    HeaderList header_list;
+    std::shared_ptr<const HeaderTemplate> header_template;
+
+    //lines of the template are used in place, a header of the request replaces the template one with the same key
+    void BuildHeaders(const std::map<std::string, std::string> &http_headers)
+    {
+#undef  __FUNC__
+#define __FUNC__ "HttpConnectionImpl::BuildHeaders"
+
+        header_list.clear();
+        if (header_template)
+        {
+            for (size_t i = 0; i < header_template->size(); ++i)
+            {
+                if (http_headers.find(header_template->key(i)) == http_headers.end())
+                {
+                    LOGd1("\t%s", header_template->line(i).c_str());
+                    header_list.append_line(header_template->line(i).c_str());
+                }
+            }
+        }
+        for (std::map<std::string, std::string>::const_iterator iter = http_headers.begin();
+            iter != http_headers.end(); iter++)
+        {
+            header_list.append(iter->first, iter->second);
+            LOGd1("\t%s", header_list.lines[header_list.line_count - 1].c_str());
+        }
+        headers = header_list.head();
+    }
+    //Response buffer owned by the connection, reused across requests and grown geometrically
     struct MemoryStruct
     {
         char *memory;
         size_t size;
-        MemoryStruct() : memory(0), size(0){}
+        size_t capacity;
+        CURL *curl;    /* to read Content-Length on the first chunk */
+        MemoryStruct() : memory(0), size(0), capacity(0), curl(0){}
+
+        bool reserve(size_t required)
+        {
+            if (required <= capacity)
+                return true;
+            size_t new_capacity = std::max(required, std::max(capacity * 2, min_capacity));
+            char *new_memory = (char*)realloc(memory, new_capacity);
+            if (new_memory == NULL)
+                return false;
+            memory = new_memory;
+            capacity = new_capacity;
+            return true;
+        }
+
+        void reset(CURL *handle)
+        {
+            curl = handle;
+            //do not pin the memory of one huge response to a pooled connection
+            if (capacity > max_retained_capacity)
+                release();
+            size = 0;
+            if (reserve(1))
+                memory[0] = '\0';
+        }
+
+        void release()
+        {
+            free(memory);
+            memory = NULL;
+            size = capacity = 0;
+        }
+
+        static constexpr size_t min_capacity = 4096;
+        static constexpr size_t max_retained_capacity = 4 * 1024 * 1024;
     };
     MemoryStruct response_body;
+    HttpConnection::ResponseSink response_sink;
     bool ssl_verify_peer;
     bool ssl_verify_host;
+    bool share_cache;
+
+    static const long warm_up_connect_timeout = 1000; //millisecond
+    static const long warm_up_timeout = 2000; //millisecond, the whole HEAD
+
+    //DNS cache and TLS sessions shared by the connections created with share_cache. A re-created
+    //connection then reuses a resolved address and resumes the TLS session instead of paying for a
+    //full resolve and handshake. The connection cache is not shared: libcurl does not support it
+    //across concurrent threads, and every socket must stay owned by the pool connection it belongs to.
+    static CURLSH *share;
+    static std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+    static CURLSH* CreateShare()
+    {
+#undef  __FUNC__
+#define __FUNC__ "HttpConnectionImpl::CreateShare"
+
+        CURLSH *handle = curl_share_init();
+        if (!handle)
+        {
+            LOGx1("curl_share_init() failed, %s", "connections keep their own caches");
+            return NULL;
+        }
+        //the pool hands connections to many threads, every shared data gets its own lock
+        curl_share_setopt(handle, CURLSHOPT_LOCKFUNC, ShareLock);
+        curl_share_setopt(handle, CURLSHOPT_UNLOCKFUNC, ShareUnlock);
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        return handle;
+    }
+
+    static void ShareLock(CURL */*handle*/, curl_lock_data data, curl_lock_access /*access*/, void */*userptr*/)
+    {
+        share_locks[data].lock();
+    }
+
+    static void ShareUnlock(CURL */*handle*/, curl_lock_data data, void */*userptr*/)
+    {
+        share_locks[data].unlock();
+    }
+
+    static std::chrono::microseconds Span(curl_off_t from, curl_off_t to)
+    {
+        return std::chrono::microseconds(to > from ? to - from : 0);
+    }
 
     static size_t WriteMemoryCallback(
         void *contents, size_t size, size_t nmemb, void *userp)
@@ -260,8 +540,15 @@ private:
         size_t realsize = size * nmemb;
         MemoryStruct *mem = (MemoryStruct *)userp;
 
-        mem->memory = (char*)realloc(mem->memory, mem->size + realsize + 1);
-        if (mem->memory == NULL) {
+        if (mem->size == 0 && mem->curl)
+        {
+            /* size hint, grow once for the whole body when the server announced it. The header is not
+               trusted beyond the retained capacity, a larger body grows geometrically as it arrives */
+            curl_off_t length = -1;
+            if (curl_easy_getinfo(mem->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK && length > 0)
+                mem->reserve((size_t)std::min<curl_off_t>(length, MemoryStruct::max_retained_capacity) + 1);
+        }
+        if (!mem->reserve(mem->size + realsize + 1)) {
             /* out of memory! */
             return 0;
         }
@@ -272,8 +559,21 @@ private:
 
         return realsize;
     }
+
+    static size_t WriteSinkCallback(
+        void *contents, size_t size, size_t nmemb, void *userp)
+    {
+        size_t realsize = size * nmemb;
+        HttpConnection::ResponseSink *sink = (HttpConnection::ResponseSink *)userp;
+
+        /* anything but realsize makes curl fail the transfer with CURLE_WRITE_ERROR */
+        return (*sink)((const char*)contents, realsize) ? realsize : 0;
+    }
 };
 
+CURLSH *HttpConnectionImpl::share = NULL;
+std::mutex HttpConnectionImpl::share_locks[CURL_LOCK_DATA_LAST];
+
 bool HTTPS_GLOBAL_INITIALIZE()
 {
     return HttpConnectionImpl::HTTPS_GLOBAL_INITIALIZE();
@@ -285,9 +585,9 @@ bool HTTPS_GLOBAL_FINALIZE()
     return true;
 }
 
-HttpConnection::HttpConnection(bool verify_peer, bool verify_host)
+HttpConnection::HttpConnection(bool verify_peer, bool verify_host, bool share_cache)
 {
-    impl = new HttpConnectionImpl(verify_peer, verify_host);
+    impl = new HttpConnectionImpl(verify_peer, verify_host, share_cache);
 }
 
 HttpConnection::~HttpConnection()
@@ -313,15 +613,31 @@ void  HttpConnection::SetHttpProxy(const char* proxy, int port, const char* uid,
 
 void HttpConnection::SetOptions(const char* url, HTTP_REQUEST_METHOD method,
     std::map<std::string, std::string>& http_headers, unsigned int timeout)
+{
+    impl->SetOptions(url, method, http_headers, std::chrono::seconds(timeout));
+}
+
+void HttpConnection::SetOptions(const char* url, HTTP_REQUEST_METHOD method,
+    std::map<std::string, std::string>& http_headers, std::chrono::milliseconds timeout)
 {
     impl->SetOptions(url, method, http_headers, timeout);
 }
 
+void HttpConnection::SetConnectTimeout(std::chrono::milliseconds timeout)
+{
+    impl->SetConnectTimeout(timeout);
+}
+
 void HttpConnection::PreparePostData(const char* data, unsigned int size)
 {
     impl->PreparePostData(data, size);
 }
 
+void HttpConnection::SetHttp2(bool prior_knowledge)
+{
+    impl->SetHttp2(prior_knowledge);
+}
+
 std::string HttpConnection::Escape(const char* input, unsigned int size)
 {
     return impl->Escape(input, size);
@@ -332,11 +648,46 @@ HTTP_ERROR_CODE HttpConnection::SendRequest(long &resp_code)
     return impl->SendRequest(resp_code);
 }
 
+CURL* HttpConnection::Handle()
+{
+    return impl->Handle();
+}
+
+HTTP_ERROR_CODE HttpConnection::FinishRequest(CURLcode res, long &resp_code)
+{
+    return impl->FinishRequest(res, resp_code);
+}
+
 char* HttpConnection::GetResponseBody()
 {
     return impl->GetResponseBody();
 }
 
+size_t HttpConnection::GetResponseSize()
+{
+    return impl->GetResponseSize();
+}
+
+void HttpConnection::GetTimings(HttpTimings &timings)
+{
+    impl->GetTimings(timings);
+}
+
+void HttpConnection::SetHeaderTemplate(const std::shared_ptr<const HeaderTemplate> &header_template)
+{
+    impl->SetHeaderTemplate(header_template);
+}
+
+void HttpConnection::SetResponseSink(ResponseSink sink)
+{
+    impl->SetResponseSink(std::move(sink));
+}
+
+void HttpConnection::ReserveResponse(size_t size)
+{
+    impl->ReserveResponse(size);
+}
+
 void HttpConnection::SetMultiPartFile(std::string key, std::string &path){
     impl->SetMultiPartFile(key, path);
 }
@@ -346,6 +697,10 @@ void HttpConnection::SetMultiPartBuffer(std::string key, const char *buffer, siz
 }
 
 void HttpConnection::SetMultiPartOptions(const char* url, std::map<std::string, std::string>& http_headers, unsigned int timeout){
+    impl->SetMultiPartOptions(url, http_headers, std::chrono::seconds(timeout));
+}
+
+void HttpConnection::SetMultiPartOptions(const char* url, std::map<std::string, std::string>& http_headers, std::chrono::milliseconds timeout){
     impl->SetMultiPartOptions(url, http_headers, timeout);
 }
 
@@ -355,4 +710,8 @@ bool HttpConnection::connect() {
 
 bool HttpConnection::disconnect() {
     return Finalize();
+}
+
+bool HttpConnection::warm_up(const std::string &destination) {
+    return impl->WarmUp("http://" + destination + "/");
 }
\ No newline at end of file
@@ -3,6 +3,10 @@
 
 #include <string>
 #include <map>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <functional>
 #include <curl/curl.h>
 #include "./Util/ConnectionFactory.h"
 
@@ -25,34 +29,121 @@ enum HTTP_ERROR_CODE
     HTTP_SERVER_ERROR,
     HTTP_UNKNOWN,
     HTTP_REPORT_SERVICE_RETRY,
+    HTTP_DEADLINE_EXCEEDED,     //the deadline of the request ran out before it was sent
+};
+
+enum HTTP_REQUEST_PHASE
+{
+    HTTP_PHASE_DNS,         //name lookup
+    HTTP_PHASE_CONNECT,     //TCP connect, zero on a reused connection
+    HTTP_PHASE_TLS,         //TLS handshake
+    HTTP_PHASE_SERVER,      //request sent until the first response byte, upload and server think time
+    HTTP_PHASE_TRANSFER,    //first to last response byte
+    HTTP_PHASE_TOTAL,
+    HTTP_PHASE_COUNT,
+};
+
+//Where the time of the last request went, from the timings of curl
+struct HttpTimings
+{
+    std::chrono::microseconds phases[HTTP_PHASE_COUNT] = {};
+    curl_off_t uploaded = 0;    //bytes
+    curl_off_t downloaded = 0;  //bytes
+};
+
+//Header lines rendered once, typically the constant headers of a service client.
+//Connections read the lines in place, so a request only renders its own headers.
+class HeaderTemplate
+{
+public:
+    explicit HeaderTemplate(const std::map<std::string, std::string> &http_headers)
+    {
+        for (const auto &header : http_headers)
+        {
+            m_keys.push_back(header.first);
+            m_lines.push_back(header.first + ": " + header.second);
+        }
+    }
+
+    size_t size() const
+    {
+        return m_lines.size();
+    }
+
+    const std::string& key(size_t i) const
+    {
+        return m_keys[i];
+    }
+
+    const std::string& line(size_t i) const
+    {
+        return m_lines[i];
+    }
+
+private:
+    std::vector<std::string> m_keys;
+    std::vector<std::string> m_lines;
 };
 
 //These two function should be called only once
+//HTTPS_GLOBAL_INITIALIZE also sets up the caches of the connections created with share_cache,
+//HTTPS_GLOBAL_FINALIZE must come after all of those connections are gone
 bool HTTPS_GLOBAL_INITIALIZE();
 bool HTTPS_GLOBAL_FINALIZE();
 
 class HttpConnection : public ngmp::common::Connection
 {
 public:
-    HttpConnection(bool verify_peer, bool verify_host);
+    //Receives the body chunk by chunk as it arrives, return false to abort the transfer
+    using ResponseSink = std::function<bool(const char *data, size_t size)>;
+
+    //share_cache: share the DNS and TLS session caches with the other connections created with share_cache
+    HttpConnection(bool verify_peer, bool verify_host, bool share_cache = false);
     virtual ~HttpConnection();
 
     virtual bool Initialize();
     virtual bool Finalize();
 
     void SetHttpProxy(const char* proxy, int port, const char* uid, const char* pwd);
+    //timeout of the whole request, unit: second, 0: never
     void SetOptions(const char* url, HTTP_REQUEST_METHOD method,
         std::map<std::string, std::string>& http_headers, unsigned int timeout);
+    void SetOptions(const char* url, HTTP_REQUEST_METHOD method,
+        std::map<std::string, std::string>& http_headers, std::chrono::milliseconds timeout);
+    //Connect phase of the next request, 0: default of curl
+    void SetConnectTimeout(std::chrono::milliseconds timeout);
     void PreparePostData(const char* data, unsigned int size);
 
+    //HTTP/2 for the next request, prior_knowledge for h2c without upgrade, call after SetOptions
+    //or SetMultiPartOptions, which put back the default HTTP version.
+    //The request waits for a connection it can multiplex on rather than opening a new one.
+    void SetHttp2(bool prior_knowledge);
+
     std::string Escape(const char* input, unsigned int size);
 
     HTTP_ERROR_CODE SendRequest(long &resp_code);
+
+    //For an event loop performing the transfer instead of SendRequest
+    CURL* Handle();
+    HTTP_ERROR_CODE FinishRequest(CURLcode res, long &resp_code);
     char* GetResponseBody();
+    size_t GetResponseSize();
+    //Valid after SendRequest or FinishRequest, until the next request starts
+    void GetTimings(HttpTimings &timings);
+    //Constant headers of the next request, call before SetOptions or SetMultiPartOptions.
+    //A header passed to those replaces the template one with the same key.
+    void SetHeaderTemplate(const std::shared_ptr<const HeaderTemplate> &header_template);
+
+    //Stream the body of the next request to sink instead of buffering it, call after SetOptions
+    void SetResponseSink(ResponseSink sink);
+
+    //Size hint for the response, call after SetOptions. The buffer otherwise grows from Content-Length or geometrically
+    void ReserveResponse(size_t size);
 
     void SetMultiPartFile(std::string  key, std::string & path);
     void SetMultiPartBuffer(std::string key, const char *buffer, size_t size, const std::string &name = "filename");
     void SetMultiPartOptions(const char *url, std::map<std::string, std::string> &http_headers, unsigned int timeout);
+    void SetMultiPartOptions(const char *url, std::map<std::string, std::string> &http_headers, std::chrono::milliseconds timeout);
 
     static const std::string methodName(HTTP_REQUEST_METHOD method)
     {
@@ -70,6 +161,8 @@ private:
 
     virtual bool disconnect() override;
 
+    virtual bool warm_up(const std::string &destination) override;
+
 private:
     HttpConnectionImpl* impl;
 };
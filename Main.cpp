@@ -14,10 +14,11 @@ int main() {
     static std::once_flag flag;
     std::call_once(flag, []()
     {
+        HTTPS_GLOBAL_INITIALIZE();
         connectionPool = std::make_shared<ngmp::common::ConnectionPool>();
         if (connectionPool)
         {
-            connectionPool->set_connection_factory(std::make_shared<CurlFactory>());
+            connectionPool->set_connection_factory(std::make_shared<CurlFactory>(true));
         }
     });
 
@@ -42,6 +43,10 @@ int main() {
     ADDSERVICECLIENTOBJ(NrdClient, "nrd", "Scan\\NRD");
     ADDSERVICECLIENTOBJ(DMARCMonitorClient, "dmarcmonitor", "Scan\\DMARCMonitor");
 
+    //the shared caches are cleaned up after the last connection using them is gone
+    g_tls_service_client.clear();
+    connectionPool.reset();
+    HTTPS_GLOBAL_FINALIZE();
 
     return 0;
 }
\ No newline at end of file
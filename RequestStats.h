@@ -0,0 +1,70 @@
+#ifndef _REQUESTSTATS_H_
+#define _REQUESTSTATS_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include "HttpConnection.h"
+#include "./Util/DestinationRegistry.h"
+#include "./Util/LatencyHistogram.h"
+
+/*
+ * Phase histograms and transferred bytes of every request to one destination,
+ * shared by all the clients of that destination whatever thread they run on.
+ * Recording takes no lock.
+ */
+class RequestStats final
+{
+public:
+    RequestStats() = default;
+
+    RequestStats(const RequestStats&) = delete;
+    RequestStats& operator=(const RequestStats&) = delete;
+
+    void record(const HttpTimings &timings)
+    {
+        for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase)
+        {
+            m_phases[phase].record(timings.phases[phase]);
+        }
+        m_uploaded.fetch_add(timings.uploaded, std::memory_order_relaxed);
+        m_downloaded.fetch_add(timings.downloaded, std::memory_order_relaxed);
+    }
+
+    const LatencyHistogram& histogram(HTTP_REQUEST_PHASE phase) const
+    {
+        return m_phases[phase];
+    }
+
+    uint64_t bytes_uploaded() const
+    {
+        return m_uploaded.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bytes_downloaded() const
+    {
+        return m_downloaded.load(std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        for (LatencyHistogram &histogram : m_phases)
+        {
+            histogram.reset();
+        }
+        m_uploaded.store(0, std::memory_order_relaxed);
+        m_downloaded.store(0, std::memory_order_relaxed);
+    }
+
+    static std::shared_ptr<RequestStats> of(const std::string &destination)
+    {
+        return DestinationRegistry<RequestStats>::get(destination);
+    }
+
+private:
+    LatencyHistogram m_phases[HTTP_PHASE_COUNT];
+    std::atomic<uint64_t> m_uploaded{0};
+    std::atomic<uint64_t> m_downloaded{0};
+};
+
+#endif // _REQUESTSTATS_H_
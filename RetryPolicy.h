@@ -0,0 +1,152 @@
+#ifndef _RETRYPOLICY_H_
+#define _RETRYPOLICY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include "HttpConnection.h"
+#include "./Util/DestinationRegistry.h"
+
+/*
+ * Decides whether a failed attempt is retried and how long to wait before.
+ * Shared by the threads of a client, so implementations must be thread safe.
+ */
+class RetryPolicy
+{
+public:
+    virtual ~RetryPolicy() = default;
+
+    virtual bool retryable(HTTP_ERROR_CODE err) const = 0;
+
+    // wait before retry number attempt (from 1), previous is the wait before the last one, 0 for the first
+    virtual std::chrono::milliseconds backoff(unsigned int attempt, std::chrono::milliseconds previous) const = 0;
+};
+
+/*
+ * Retries timeouts, network and server errors, and redirects to another
+ * service. Waits follow exponential backoff with decorrelated jitter:
+ * random between base and three times the previous wait, at most cap, so
+ * the retries of many threads do not hit the backend in lockstep.
+ */
+class ExponentialBackoffRetry : public RetryPolicy
+{
+public:
+    explicit ExponentialBackoffRetry(std::chrono::milliseconds base = std::chrono::milliseconds(10),
+                                     std::chrono::milliseconds cap = std::chrono::milliseconds(1000)) :
+        m_base(base),
+        m_cap(std::max(cap, base))
+    {
+    }
+
+    virtual bool retryable(HTTP_ERROR_CODE err) const override
+    {
+        switch (err)
+        {
+            case HTTP_TIMEOUT:
+            case HTTP_NETWORK_ERROR:
+            case HTTP_SERVER_ERROR:
+            case HTTP_REPORT_SERVICE_RETRY:
+            case HTTP_UNKNOWN:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    virtual std::chrono::milliseconds backoff(unsigned int /*attempt*/, std::chrono::milliseconds previous) const override
+    {
+        if (m_base == std::chrono::milliseconds::zero())
+        {
+            return m_base;
+        }
+        const std::chrono::milliseconds upper = std::min(m_cap, std::max(previous * 3, m_base));
+        static thread_local std::mt19937 generator{std::random_device{}()};
+        std::uniform_int_distribution<std::chrono::milliseconds::rep> distribution(m_base.count(), upper.count());
+        return std::chrono::milliseconds(distribution(generator));
+    }
+
+private:
+    const std::chrono::milliseconds m_base;
+    const std::chrono::milliseconds m_cap;
+};
+
+/*
+ * Token bucket bounding the retries to a destination to a ratio of its
+ * successful requests, shared by every client of the destination. Each
+ * success adds ratio of a token, each retry takes a whole one, and the
+ * bucket holds at most max_tokens, the burst allowed after a quiet period.
+ * During an outage successes stop, the bucket drains, and retries stop
+ * adding load to the backend.
+ */
+class RetryBudget final
+{
+public:
+    explicit RetryBudget(double ratio = 0.1, unsigned int max_tokens = 10)
+    {
+        set_budget(ratio, max_tokens);
+        m_tokens = m_max_tokens.load();
+    }
+
+    RetryBudget(const RetryBudget&) = delete;
+    RetryBudget& operator=(const RetryBudget&) = delete;
+
+    void set_budget(double ratio, unsigned int max_tokens)
+    {
+        m_ratio = (int64_t)(ratio * unit);
+        m_max_tokens = (int64_t)max_tokens * unit;
+    }
+
+    void on_success()
+    {
+        const int64_t max_tokens = m_max_tokens.load(std::memory_order_relaxed);
+        int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+        while (tokens < max_tokens &&
+               !m_tokens.compare_exchange_weak(tokens, std::min(tokens + m_ratio.load(std::memory_order_relaxed), max_tokens),
+                                               std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // false when the budget is spent and the retry must not be sent
+    bool try_retry()
+    {
+        int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+        while (tokens >= unit)
+        {
+            if (m_tokens.compare_exchange_weak(tokens, tokens - unit, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // give back the token of a try_retry whose retry was not sent after all
+    void refund()
+    {
+        const int64_t max_tokens = m_max_tokens.load(std::memory_order_relaxed);
+        int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+        while (tokens < max_tokens &&
+               !m_tokens.compare_exchange_weak(tokens, std::min(tokens + unit, max_tokens), std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // purpose tells apart the budgets of one destination, e.g. retries and hedges
+    static std::shared_ptr<RetryBudget> of(const std::string &destination, const std::string &purpose = "retry")
+    {
+        return DestinationRegistry<RetryBudget>::get(purpose + " " + destination);
+    }
+
+private:
+    static constexpr int64_t unit = 1000; // a token, fixed point
+
+    std::atomic<int64_t> m_ratio;
+    std::atomic<int64_t> m_max_tokens;
+    std::atomic<int64_t> m_tokens;
+};
+
+#endif // _RETRYPOLICY_H_
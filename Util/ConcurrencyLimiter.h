@@ -0,0 +1,228 @@
+#ifndef CONCURRENCYLIMITER_H
+#define CONCURRENCYLIMITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "DestinationRegistry.h"
+
+/*
+ * Adaptive limit of the requests in flight to one destination, shared by
+ * every client of the destination.
+ *
+ * GRADIENT compares the short-term round trip time with the long-term one,
+ * the latency of the backend when it is not queueing. While they are close
+ * the limit grows by about its square root per sample window. Once requests
+ * start to queue at the backend the ratio drops below one and the limit
+ * shrinks with it. Both algorithms cut the limit by backoff_ratio when a
+ * request fails by timeout or overload, AIMD otherwise only adds one per
+ * limit successful requests.
+ */
+class ConcurrencyLimiter final
+{
+public:
+    enum Algorithm
+    {
+        GRADIENT,
+        AIMD,
+    };
+
+    // A slot of the limit, given back when released or destroyed
+    class Permit
+    {
+    public:
+        Permit() = default;
+        ~Permit()
+        {
+            if (m_limiter)
+            {
+                m_limiter->release(nullptr, false);
+            }
+        }
+
+        Permit(Permit &&other) : m_limiter(std::move(other.m_limiter))
+        {
+            other.m_limiter.reset();
+        }
+
+        Permit& operator=(Permit &&other)
+        {
+            if (this != &other)
+            {
+                if (m_limiter)
+                {
+                    m_limiter->release(nullptr, false);
+                }
+                m_limiter = std::move(other.m_limiter);
+                other.m_limiter.reset();
+            }
+            return *this;
+        }
+
+        Permit(const Permit&) = delete;
+        Permit& operator=(const Permit&) = delete;
+
+        explicit operator bool() const
+        {
+            return m_limiter != nullptr;
+        }
+
+        // rtt of the request, dropped when it failed by timeout or overload
+        void release(std::chrono::microseconds rtt, bool dropped)
+        {
+            if (m_limiter)
+            {
+                m_limiter->release(&rtt, dropped);
+                m_limiter.reset();
+            }
+        }
+
+    private:
+        friend class ConcurrencyLimiter;
+        std::shared_ptr<ConcurrencyLimiter> m_limiter;
+    };
+
+    ConcurrencyLimiter() = default;
+
+    ConcurrencyLimiter(const ConcurrencyLimiter&) = delete;
+    ConcurrencyLimiter& operator=(const ConcurrencyLimiter&) = delete;
+
+    void set_limits(unsigned int initial_limit, unsigned int min_limit, unsigned int max_limit)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_min_limit = std::max(min_limit, 1u);
+        m_max_limit = std::max(max_limit, m_min_limit);
+        m_limit = std::min<double>(std::max(initial_limit, m_min_limit), m_max_limit);
+    }
+
+    void set_algorithm(Algorithm algorithm)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_algorithm = algorithm;
+    }
+
+    unsigned int limit() const
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return (unsigned int)m_limit;
+    }
+
+    unsigned int in_flight() const
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_in_flight;
+    }
+
+    /*
+     * An empty permit when the limit is reached for longer than max_wait,
+     * 0 rejects at once. Waiters are woken as requests complete.
+    */
+    static Permit acquire(const std::shared_ptr<ConcurrencyLimiter> &limiter, std::chrono::milliseconds max_wait)
+    {
+        Permit permit;
+        std::unique_lock<std::mutex> lock(limiter->m_mtx);
+        auto below_limit = [&limiter]()
+        {
+            return limiter->m_in_flight < (unsigned int)limiter->m_limit;
+        };
+        if (!below_limit() &&
+            (max_wait <= std::chrono::milliseconds::zero() ||
+             !limiter->m_condition.wait_for(lock, max_wait, below_limit)))
+        {
+            return permit;
+        }
+        ++limiter->m_in_flight;
+        permit.m_limiter = limiter;
+        return permit;
+    }
+
+    static std::shared_ptr<ConcurrencyLimiter> of(const std::string &destination)
+    {
+        return DestinationRegistry<ConcurrencyLimiter>::get(destination);
+    }
+
+private:
+    // rtt null: the request did not complete, no sample
+    void release(const std::chrono::microseconds *rtt, bool dropped)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            // requests far below the limit say nothing about how high it may go
+            const bool app_limited = m_in_flight * 2 < m_limit;
+            --m_in_flight;
+            if (rtt)
+            {
+                dropped ? on_drop() : on_sample(*rtt, app_limited);
+            }
+        }
+        m_condition.notify_all(); // the limit may have grown by more than one
+    }
+
+    void on_drop()
+    {
+        m_limit = std::max<double>(m_limit * backoff_ratio, m_min_limit);
+        m_window_samples = 0;
+        m_window_rtt = 0;
+    }
+
+    void on_sample(std::chrono::microseconds rtt, bool app_limited)
+    {
+        if (m_algorithm == AIMD)
+        {
+            if (!app_limited)
+            {
+                m_limit = std::min<double>(m_limit + 1 / m_limit, m_max_limit);
+            }
+            return;
+        }
+
+        m_window_rtt += rtt.count();
+        if (++m_window_samples < std::max(min_window_samples, (unsigned int)m_limit))
+        {
+            return;
+        }
+        const double short_rtt = std::max(m_window_rtt / m_window_samples, 1.0);
+        m_window_samples = 0;
+        m_window_rtt = 0;
+
+        m_long_rtt = m_long_rtt == 0 ? short_rtt : m_long_rtt * (1 - long_rtt_alpha) + short_rtt * long_rtt_alpha;
+        if (m_long_rtt > short_rtt * 2)
+        {
+            m_long_rtt = short_rtt * 2; // recover quickly once the backend got faster for good
+        }
+        if (app_limited)
+        {
+            return;
+        }
+
+        const double gradient = std::max(0.5, std::min(1.0, rtt_tolerance * m_long_rtt / short_rtt));
+        const double new_limit = m_limit * gradient + std::sqrt(m_limit);
+        m_limit = m_limit * (1 - smoothing) + new_limit * smoothing;
+        m_limit = std::min<double>(std::max<double>(m_limit, m_min_limit), m_max_limit);
+    }
+
+private:
+    static constexpr double backoff_ratio = 0.9;
+    static constexpr double rtt_tolerance = 1.5;    // short rtt up to 1.5 times the long one is not queueing yet
+    static constexpr double long_rtt_alpha = 0.05;  // about the last 20 sample windows
+    static constexpr double smoothing = 0.2;
+    static constexpr unsigned int min_window_samples = 10;
+
+    mutable std::mutex m_mtx;
+    std::condition_variable m_condition;
+    Algorithm m_algorithm = GRADIENT;
+    double m_limit = 20;
+    unsigned int m_min_limit = 1;
+    unsigned int m_max_limit = 1000;
+    unsigned int m_in_flight = 0;
+
+    double m_long_rtt = 0;    // unit: microsecond
+    double m_window_rtt = 0;  // sum of the current sample window
+    unsigned int m_window_samples = 0;
+};
+
+#endif // CONCURRENCYLIMITER_H
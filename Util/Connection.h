@@ -1,8 +1,10 @@
 #ifndef _CONNECTION_H
 #define _CONNECTION_H
 
+#include <atomic>
 #include <chrono>
 #include <memory>
+#include <string>
 
 namespace ngmp {
 namespace common {
@@ -21,8 +23,12 @@ private:
 
     bool is_expired() const
     {
-        const std::chrono::seconds::rep idle_time = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - m_last_used_time).count();
-        return idle_time > m_idle_timeout;
+        return std::chrono::steady_clock::now() >= expire_time();
+    }
+
+    std::chrono::steady_clock::time_point expire_time() const
+    {
+        return m_last_used_time + std::chrono::seconds(m_idle_timeout);
     }
 
     void set_last_used_time()
@@ -40,9 +46,16 @@ public:
 
     virtual bool disconnect() = 0;
 
+    // Establish the transport to destination ahead of the first request, used by pool warm-up
+    virtual bool warm_up(const std::string &/*destination*/)
+    {
+        return true;
+    }
+
 private:
     unsigned int m_idle_timeout;
     std::chrono::steady_clock::time_point m_last_used_time;
+    std::atomic<const void*> m_lent_by{nullptr}; // pool destination which handed it out, null while idle
 
 };
 
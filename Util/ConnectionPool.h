@@ -4,13 +4,16 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <chrono>
 #include <cassert>
 #include <atomic>
 #include <numeric>
 #include <algorithm>
 #include <functional>
-#include <unordered_set>
+#include <deque>
+#include <queue>
+#include <vector>
 #include <unordered_map>
 #include <condition_variable>
 
@@ -20,29 +23,116 @@
 namespace ngmp {
 namespace common {
 
+struct ConnectionPolicy
+{
+    unsigned int max_connections = 0; // 0: unlimited connections
+    unsigned int idle_timeout = 60; // unit: second
+    unsigned int min_idle = 0;
+    std::chrono::milliseconds acquire_timeout{0}; // same meaning as the timeout of ConnectionPool::get_connection
+
+    // Streams a multiplexed (HTTP/2) transport carries on one connection. Pooled
+    // connections are then streams, and up to max_connections * max_streams_per_connection
+    // of them are handed out while the transport keeps max_connections sockets.
+    unsigned int max_streams_per_connection = 1;
+
+    unsigned int capacity() const
+    {
+        return max_connections * std::max(max_streams_per_connection, 1u);
+    }
+};
+
 class ConnectionPool final
 {
-    using Connections = std::unordered_set<std::shared_ptr<Connection>>;
+    // LIFO stack ordered by last used time: back is the warmest connection,
+    // front the coldest one which expires first
+    using Connections = std::deque<std::shared_ptr<Connection>>;
+
+    // A caller blocked in get_connection, woken only when something is handed to it
+    struct Waiter
+    {
+        std::condition_variable condition;
+        std::shared_ptr<Connection> connection; // handed off by a release
+        bool slot = false; // a free slot was reserved for it, the waiter creates the connection
+    };
+
+    // All state of one destination, guarded by its own lock so that
+    // unrelated destinations never contend with each other
+    struct Destination
+    {
+        Destination(const std::string &name, const ConnectionPolicy &policy) : name(name), policy(policy)
+        {}
+
+        const std::string name;
+        ConnectionPolicy policy;
+        Connections idle;
+        unsigned int busy = 0; // handed out, each of them marked as lent by this destination
+        unsigned int warming = 0; // being opened in background, counted against the limit
+        unsigned int pending = 0; // being created for a caller outside the lock, counted against the limit
+        bool scheduled = false; // an expiry of the idle stack is queued in the cleaner
+        std::chrono::steady_clock::time_point scheduled_at; // when it is due, older entries of the heap are stale
+        std::deque<Waiter*> waiters; // FIFO, the oldest waiter is served first
+        std::mutex mtx;
+    };
+
+    struct WarmUp
+    {
+        std::shared_ptr<Destination> dest;
+        unsigned int count;
+    };
+
+    struct Expiry
+    {
+        std::chrono::steady_clock::time_point when;
+        std::shared_ptr<Destination> dest;
+
+        bool operator>(const Expiry &other) const
+        {
+            return when > other.when;
+        }
+    };
 
 public:
-    explicit ConnectionPool(unsigned int max_connections = 0, unsigned int idle_timeout = 60, unsigned int clean_interval = 60) :
-        m_max_connections(max_connections), m_idle_timeout(idle_timeout), m_clean_interval(clean_interval)
+    explicit ConnectionPool(unsigned int max_connections = 0, unsigned int idle_timeout = 60) :
+        ConnectionPool(ConnectionPolicy{max_connections, idle_timeout})
+    {
+    }
+
+    // expiries are driven by the idle connections themselves, clean_interval is ignored
+    [[deprecated("clean_interval is ignored, use ConnectionPool(max_connections, idle_timeout)")]]
+    ConnectionPool(unsigned int max_connections, unsigned int idle_timeout, unsigned int /*clean_interval*/) :
+        ConnectionPool(max_connections, idle_timeout)
+    {
+    }
+
+    // policy applies to every destination without a policy of its own
+    explicit ConnectionPool(const ConnectionPolicy &policy) :
+        m_default_policy(policy)
     {
         m_stop = false;
-        assert(idle_timeout > 0);
-        assert(max_connections >= 0);
-        assert(clean_interval > 0);
+        assert(policy.idle_timeout > 0);
 
         start_clean_connection();
+        m_warm_up_thread = std::thread(&ConnectionPool::warm_up_connections, this);
     }
 
     ~ConnectionPool()
     {
-        if (m_clean_thread.joinable())
         {
+            std::lock_guard<std::mutex> clean_lock(m_clean_mtx);
+            std::lock_guard<std::mutex> warm_up_lock(m_warm_up_mtx);
             m_stop = true;
+        }
+        m_clean_condition.notify_one();
+        m_warm_up_condition.notify_one();
+
+        if (m_clean_thread.joinable())
+        {
             m_clean_thread.join();
         }
+        if (m_warm_up_thread.joinable())
+        {
+            m_warm_up_thread.join();
+        }
     }
 
 private:
@@ -50,75 +140,161 @@ private:
     ConnectionPool& operator=(const ConnectionPool&) = delete;
 
 public:
+    // wait for the acquire_timeout of the destination policy
+    std::shared_ptr<Connection> get_connection(const std::string &destination)
+    {
+        return acquire_connection(destination, nullptr);
+    }
+
     /*
-     * timeout_time:
-     * -1: block until valid connection
+     * timeout:
+     * <0: block until valid connection
      * 0:  not wait
-     * >0: wait until timewait or valid connection
+     * >0: wait until timeout or valid connection
+     * Waiters of a destination are served in FIFO order.
     */
-    std::shared_ptr<Connection> get_connection(const std::string &destination, int timeout = 0)
+    std::shared_ptr<Connection> get_connection(const std::string &destination, std::chrono::milliseconds timeout)
     {
-        if (m_stop)
+        return acquire_connection(destination, &timeout);
+    }
+
+    // wait for the acquire_timeout of the destination policy, but never past deadline
+    std::shared_ptr<Connection> get_connection(const std::string &destination, std::chrono::steady_clock::time_point deadline)
+    {
+        return acquire_connection(destination, nullptr, deadline);
+    }
+
+    bool release_connection(const std::string &destination, std::shared_ptr<Connection> connection)
+    {
+        std::shared_ptr<Destination> dest = find_destination(destination, false);
+        if (connection == nullptr || dest == nullptr)
         {
-            return nullptr;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        if (!take_back(*dest, *connection))
+        {
+            return false;   // not handed out by this destination, or released already
         }
+        push_idle(dest, connection);
+        return true;
+    }
 
-        timeout = timeout < 0 ? -1 : timeout;
-        const std::chrono::seconds timeout_time = std::chrono::duration<unsigned int>(timeout);
-        auto valid_idle_connection = [&destination, this]()
+    // Give back a connection which must not be reused, e.g. after a network error.
+    // Its slot is freed and the connection is closed once the caller drops it.
+    bool discard_connection(const std::string &destination, std::shared_ptr<Connection> connection)
+    {
+        std::shared_ptr<Destination> dest = find_destination(destination, false);
+        if (connection == nullptr || dest == nullptr)
         {
-            if (m_connections_idle.find(destination) == m_connections_idle.end() ||
-                m_connections_idle.at(destination).empty())
-            {
-                return false;
-            }
-            auto iter = std::find_if(m_connections_idle.at(destination).cbegin(), m_connections_idle.at(destination).cend(),
-                                    [](const std::shared_ptr<Connection> &connection)
-                                    {
-                                        return !connection->is_expired();
-                                    }
-            );
-            return iter != m_connections_idle.at(destination).cend();
-        };
-        std::unique_lock<std::mutex> lock(m_connections_mtx);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        if (!take_back(*dest, *connection))
+        {
+            return false;
+        }
+        grant_slots(*dest);
+        return true;
+    }
 
-        if (m_connnections_condition.wait_for(lock, timeout_time, valid_idle_connection))
+    /*
+     * Open count connections to destination in background, so the first
+     * requests do not pay for the handshake. Never exceeds max_connections.
+     * The warm-up thread opens them, one destination at a time per turn.
+    */
+    void warm_up(const std::string &destination, unsigned int count)
+    {
+        std::shared_ptr<Destination> dest = find_destination(destination, true);
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        request_warm_up(dest, count);
+    }
+
+    /*
+     * Register the limits of one destination, may be called at any time.
+     * The policy is kept with the destination state, so acquire and release
+     * read it under the destination lock they take anyway. Missing idle
+     * connections of the min_idle floor are opened right away, and again
+     * whenever the cleaner evicts. Expired connections of the floor are
+     * closed like any other, the server may have dropped them already,
+     * and fresh ones are opened in their place.
+    */
+    void set_policy(const std::string &destination, const ConnectionPolicy &policy)
+    {
+        assert(policy.idle_timeout > 0);
+
+        apply_policy(find_destination(destination, true), policy);
+
+        std::vector<std::string> linked;
         {
-            for (const std::shared_ptr<Connection> connection : m_connections_idle[destination])
+            std::shared_lock<std::shared_mutex> lock(m_destinations_mtx);
+            for (const auto &link : m_links)
             {
-                if (!connection->is_expired())
+                if (link.second == destination)
                 {
-                    m_connections_busy[destination].insert(connection);
-                    m_connections_idle[destination].erase(connection);
-                    return connection;
+                    linked.push_back(link.first);
                 }
             }
         }
-        if ((m_max_connections == 0 || all_size(destination) < m_max_connections) && m_connection_factory)
+        for (const std::string &pool : linked)
+        {
+            apply_policy(find_destination(pool, true), policy);
+        }
+    }
+
+    /*
+     * The pool named pool follows the policy of destination, the current one
+     * and those of later set_policy calls, e.g. the pool of one replica
+     * address follows the policy set on the name of the service.
+    */
+    void link(const std::string &pool, const std::string &destination)
+    {
+        std::shared_ptr<Destination> parent;
         {
-            std::shared_ptr<Connection> connection = m_connection_factory->create_connection();
-            if (connection)
+            std::lock_guard<std::shared_mutex> lock(m_destinations_mtx);
+            m_links[pool] = destination;
+            auto iter = m_destinations.find(destination);
+            if (iter != m_destinations.end())
             {
-                connection->set_idle_timeout(m_idle_timeout);
-                m_connections_busy[destination].insert(connection);
-                return connection;
+                parent = iter->second;
             }
         }
-        return nullptr;
+        if (!parent)
+        {
+            return; // the default policy until set_policy of destination
+        }
+        ConnectionPolicy policy;
+        {
+            std::lock_guard<std::mutex> lock(parent->mtx);
+            policy = parent->policy;
+        }
+        apply_policy(find_destination(pool, true), policy);
     }
 
-    bool release_connection(const std::string &destination, std::shared_ptr<Connection> connection)
+    /*
+     * The pool named pool is no longer in use, e.g. the replica address was
+     * dropped from the endpoints of its service. It stops following the
+     * policy it was linked to, keeps no min_idle floor and its idle
+     * connections are closed. Connections still handed out are closed on
+     * their expiry once released.
+    */
+    void unlink(const std::string &pool)
     {
-        if (connection == nullptr || m_connections_busy.find(destination) == m_connections_busy.end())
         {
-            return false;
+            std::lock_guard<std::shared_mutex> lock(m_destinations_mtx);
+            m_links.erase(pool);
         }
-        std::lock_guard<std::mutex> lock(m_connections_mtx);
-        m_connections_idle[destination].insert(connection);
-        m_connections_busy[destination].erase(connection);
-        connection->set_last_used_time();
-        m_connnections_condition.notify_one();
-        return true;
+        std::shared_ptr<Destination> dest = find_destination(pool, false);
+        if (!dest)
+        {
+            return;
+        }
+        Connections idle; // closed after the destination lock is released
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        dest->policy = m_default_policy;
+        dest->policy.min_idle = 0;
+        idle.swap(dest->idle);
+        grant_slots(*dest);
     }
 
     void set_connection_factory(std::shared_ptr<ConnectionFactory> connection_factory)
@@ -127,80 +303,401 @@ public:
     }
 
 private:
+    void apply_policy(const std::shared_ptr<Destination> &dest, const ConnectionPolicy &policy)
+    {
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        dest->policy = policy;
+        for (const std::shared_ptr<Connection> &connection : dest->idle)
+        {
+            connection->set_idle_timeout(policy.idle_timeout);
+        }
+        if (!dest->idle.empty())
+        {
+            schedule_expiry(dest, dest->idle.front()->expire_time());
+        }
+        grant_slots(*dest);
+        fill_min_idle(dest);
+    }
+
+    std::shared_ptr<Connection> acquire_connection(const std::string &destination, const std::chrono::milliseconds *timeout_ptr,
+                                                   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+    {
+        if (m_stop)
+        {
+            return nullptr;
+        }
+
+        std::shared_ptr<Destination> dest = find_destination(destination, true);
+        std::unique_lock<std::mutex> lock(dest->mtx);
+
+        // queued waiters came first, only serve right away when nobody waits
+        if (dest->waiters.empty())
+        {
+            // the warmest connection is the last to expire, if it has expired so have all the others
+            if (!dest->idle.empty() && !dest->idle.back()->is_expired())
+            {
+                std::shared_ptr<Connection> connection = std::move(dest->idle.back());
+                dest->idle.pop_back();
+                lend(*dest, *connection);
+                return connection;
+            }
+            if (can_create_connection(*dest))
+            {
+                ++dest->pending;
+                return create_connection(dest, lock);
+            }
+        }
+
+        std::chrono::milliseconds timeout = timeout_ptr ? *timeout_ptr : dest->policy.acquire_timeout;
+        if (deadline != std::chrono::steady_clock::time_point::max())
+        {
+            const std::chrono::milliseconds remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining <= std::chrono::milliseconds::zero())
+            {
+                timeout = std::chrono::milliseconds::zero();
+            }
+            else if (timeout < std::chrono::milliseconds::zero() || timeout > remaining)
+            {
+                timeout = remaining;
+            }
+        }
+        if (timeout == std::chrono::milliseconds::zero())
+        {
+            return nullptr;
+        }
+
+        Waiter waiter;
+        dest->waiters.push_back(&waiter);
+        auto handed_off = [&waiter]()
+        {
+            return waiter.connection || waiter.slot;
+        };
+        if (timeout < std::chrono::milliseconds::zero())
+        {
+            waiter.condition.wait(lock, handed_off);
+        }
+        else if (!waiter.condition.wait_until(lock, std::chrono::steady_clock::now() + timeout, handed_off))
+        {
+            dest->waiters.erase(std::find(dest->waiters.begin(), dest->waiters.end(), &waiter));
+            return nullptr;
+        }
+
+        if (waiter.connection)
+        {
+            return waiter.connection;   // counted as busy by the hand-off
+        }
+        return create_connection(dest, lock);   // counted as pending by the hand-off
+    }
+
+    // Called with the destination lock held and a pending slot reserved,
+    // connects without holding the lock
+    std::shared_ptr<Connection> create_connection(const std::shared_ptr<Destination> &dest, std::unique_lock<std::mutex> &lock)
+    {
+        // expired idle connections do not take a slot, close them on the way
+        Connections expired;
+        if (!dest->idle.empty() && dest->idle.back()->is_expired())
+        {
+            expired.swap(dest->idle);
+        }
+        lock.unlock();
+        expired.clear();
+
+        std::shared_ptr<Connection> connection = m_connection_factory->create_connection();
+
+        lock.lock();
+        --dest->pending;
+        if (!connection)
+        {
+            // the slot is free again, the next waiter may try its own creation
+            grant_slots(*dest);
+            return nullptr;
+        }
+        connection->set_idle_timeout(dest->policy.idle_timeout);
+        lend(*dest, *connection);
+        return connection;
+    }
+
+    // Called with the destination lock held
+    static void lend(Destination &dest, Connection &connection)
+    {
+        connection.m_lent_by = &dest;
+        ++dest.busy;
+    }
+
+    // Called with the destination lock held, false when dest did not hand connection out
+    static bool take_back(Destination &dest, Connection &connection)
+    {
+        const void *lent_by = &dest;
+        if (!connection.m_lent_by.compare_exchange_strong(lent_by, nullptr))
+        {
+            return false;
+        }
+        --dest.busy;
+        return true;
+    }
+
+    // Called with the destination lock held
+    bool can_create_connection(const Destination &dest) const
+    {
+        const unsigned int capacity = dest.policy.capacity();
+        return m_connection_factory && (capacity == 0 || dest.busy + dest.warming + dest.pending < capacity);
+    }
+
+    // Called with the destination lock held, hands free slots to the oldest waiters
+    void grant_slots(Destination &dest)
+    {
+        while (!dest.waiters.empty() && can_create_connection(dest))
+        {
+            Waiter *waiter = dest.waiters.front();
+            dest.waiters.pop_front();
+            ++dest.pending;
+            waiter->slot = true;
+            waiter->condition.notify_one();
+        }
+    }
+
+    // Destinations are never erased once created, so the returned pointer
+    // stays valid and only the first request of a destination takes the
+    // exclusive lock on the destination table
+    std::shared_ptr<Destination> find_destination(const std::string &destination, bool create)
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(m_destinations_mtx);
+            auto iter = m_destinations.find(destination);
+            if (iter != m_destinations.end())
+            {
+                return iter->second;
+            }
+        }
+        if (!create)
+        {
+            return nullptr;
+        }
+        std::lock_guard<std::shared_mutex> lock(m_destinations_mtx);
+        std::shared_ptr<Destination> &dest = m_destinations[destination];
+        if (!dest)
+        {
+            dest = std::make_shared<Destination>(destination, m_default_policy);
+        }
+        return dest;
+    }
+
+    // Called with the destination lock held, the oldest waiter gets the
+    // connection directly, otherwise it goes on top of the idle stack
+    void push_idle(const std::shared_ptr<Destination> &dest, const std::shared_ptr<Connection> &connection)
+    {
+        connection->set_idle_timeout(dest->policy.idle_timeout);
+        connection->set_last_used_time();
+        if (!dest->waiters.empty())
+        {
+            Waiter *waiter = dest->waiters.front();
+            dest->waiters.pop_front();
+            lend(*dest, *connection);
+            waiter->connection = connection;
+            waiter->condition.notify_one();
+            return;
+        }
+        dest->idle.push_back(connection);
+        schedule_expiry(dest, connection->expire_time());
+    }
+
+    // Called with the destination lock held
+    void request_warm_up(const std::shared_ptr<Destination> &dest, unsigned int count)
+    {
+        const unsigned int capacity = dest->policy.capacity();
+        if (capacity != 0)
+        {
+            const unsigned int size = all_size(*dest);
+            count = size < capacity ? std::min(count, capacity - size) : 0;
+        }
+        if (count == 0 || !m_connection_factory)
+        {
+            return;
+        }
+        dest->warming += count;
+        {
+            std::lock_guard<std::mutex> lock(m_warm_up_mtx);
+            m_warm_ups.push_back(WarmUp{dest, count});
+        }
+        m_warm_up_condition.notify_one();
+    }
+
+    // Called with the destination lock held
+    void fill_min_idle(const std::shared_ptr<Destination> &dest)
+    {
+        const unsigned int idle = dest->idle.size() + dest->warming;
+        if (idle < dest->policy.min_idle)
+        {
+            request_warm_up(dest, dest->policy.min_idle - idle);
+        }
+    }
+
     void start_clean_connection()
     {
         m_clean_thread = std::thread(&ConnectionPool::clean_connection, this);
     }
 
+    // Called with the destination lock held, a destination has a single live
+    // entry in the heap: nothing is queued when an earlier one is already there.
+    // Lock order is destination -> cleaner, the cleaner never holds its own
+    // lock while locking a destination
+    void schedule_expiry(const std::shared_ptr<Destination> &dest, std::chrono::steady_clock::time_point when)
+    {
+        if (dest->scheduled && dest->scheduled_at <= when)
+        {
+            return;
+        }
+        dest->scheduled = true;
+        dest->scheduled_at = when;
+
+        bool earliest = false;
+        {
+            std::lock_guard<std::mutex> lock(m_clean_mtx);
+            earliest = m_expiries.empty() || when < m_expiries.top().when;
+            m_expiries.push(Expiry{when, dest});
+        }
+        if (earliest)
+        {
+            m_clean_condition.notify_one();
+        }
+    }
+
+    /*
+     * Every destination with idle connections has one entry in the min-heap,
+     * due when its coldest connection expires. The cleaner sleeps until the
+     * earliest entry is due, trims exactly the expired connections of that
+     * destination and queues the next expiry of what is left.
+    */
     void clean_connection()
     {
-        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + std::chrono::seconds(m_clean_interval);
+        std::unique_lock<std::mutex> lock(m_clean_mtx);
         while (!m_stop)
         {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-            if (std::chrono::steady_clock::now() >= next)
+            if (m_expiries.empty())
             {
-                std::lock_guard<std::mutex> lock(m_connections_mtx);
-                auto iter_connections = m_connections_idle.begin();
-                while (iter_connections != m_connections_idle.end())
-                {
-                    Connections &connections = iter_connections->second;
-                    auto iter_connection = connections.begin();
-                    while (iter_connection != connections.end())
-                    {
-                        if ((*iter_connection)->is_expired())
-                        {
-                            iter_connection = connections.erase(iter_connection);
-                        }
-                        else
-                        {
-                            ++iter_connection;
-                        }
-                    }
-                    if (connections.empty())
-                    {
-                        iter_connections = m_connections_idle.erase(iter_connections);
-                    }
-                    else
-                    {
-                        ++iter_connections;
-                    }
-                }
-                next = std::chrono::steady_clock::now() + std::chrono::seconds(m_clean_interval);
+                m_clean_condition.wait(lock);
+                continue;
             }
+            const std::chrono::steady_clock::time_point when = m_expiries.top().when;
+            if (std::chrono::steady_clock::now() < when)
+            {
+                m_clean_condition.wait_until(lock, when);
+                continue;
+            }
+            std::shared_ptr<Destination> dest = m_expiries.top().dest;
+            m_expiries.pop();
+
+            lock.unlock();
+            evict_expired(dest, when);
+            lock.lock();
+        }
+    }
+
+    // when: due time of the heap entry, an entry replaced by an earlier one is skipped
+    void evict_expired(const std::shared_ptr<Destination> &dest, std::chrono::steady_clock::time_point when)
+    {
+        Connections expired; // closed after the destination lock is released
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        if (!dest->scheduled || dest->scheduled_at != when)
+        {
+            return;
+        }
+        dest->scheduled = false;
+        // the server may have closed an expired connection on its own keep-alive
+        // timeout, the floor is refilled with fresh ones rather than kept
+        while (!dest->idle.empty() && dest->idle.front()->is_expired())
+        {
+            expired.push_back(std::move(dest->idle.front()));
+            dest->idle.pop_front();
+        }
+        if (!dest->idle.empty())
+        {
+            schedule_expiry(dest, dest->idle.front()->expire_time());
         }
+        fill_min_idle(dest);
     }
 
-    unsigned int idle_size(const std::string &destination) const
+    /*
+     * Requested warm-ups are opened on their own thread, outside of any pool
+     * lock, since a warm-up blocks for its handshake and the cleaner must
+     * stay on time. One connection is opened per turn and the rest of the
+     * request goes back to the end of the queue, so an unreachable
+     * destination delays the warm-ups of the others by a single connect.
+    */
+    void warm_up_connections()
     {
-        return m_connections_idle.find(destination) != m_connections_idle.end() ?
-                m_connections_idle.at(destination).size() : 0;
+        std::unique_lock<std::mutex> lock(m_warm_up_mtx);
+        while (!m_stop)
+        {
+            if (m_warm_ups.empty())
+            {
+                m_warm_up_condition.wait(lock);
+                continue;
+            }
+            WarmUp warm_up = m_warm_ups.front();
+            m_warm_ups.pop_front();
+            if (warm_up.count > 1)
+            {
+                m_warm_ups.push_back(WarmUp{warm_up.dest, warm_up.count - 1});
+            }
+
+            lock.unlock();
+            open_connection(warm_up.dest);
+            lock.lock();
+        }
     }
 
-    unsigned int busy_size(const std::string &destination) const
+    void open_connection(const std::shared_ptr<Destination> &dest)
     {
-        return m_connections_busy.find(destination) != m_connections_busy.end() ?
-                m_connections_busy.at(destination).size() : 0;
+        std::shared_ptr<Connection> connection;
+        if (!m_stop)
+        {
+            connection = m_connection_factory->create_connection();
+        }
+        if (connection)
+        {
+            if (!connection->warm_up(dest->name))
+            {
+                connection.reset();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(dest->mtx);
+        --dest->warming;
+        if (connection)
+        {
+            push_idle(dest, connection);
+        }
+        else
+        {
+            grant_slots(*dest);
+        }
     }
 
-    unsigned int all_size(const std::string &destination) const
+    static unsigned int all_size(const Destination &dest)
     {
-        return  idle_size(destination) + busy_size(destination);
+        return dest.idle.size() + dest.busy + dest.warming + dest.pending;
     }
 
 private:
-    std::unordered_map<std::string, Connections> m_connections_idle;  // key: destination
-    std::unordered_map<std::string, Connections> m_connections_busy;
+    std::unordered_map<std::string, std::shared_ptr<Destination>> m_destinations;  // key: destination
+    std::unordered_map<std::string, std::string> m_links;  // key: pool, value: destination whose policy it follows
+    std::shared_mutex m_destinations_mtx;
 
     std::shared_ptr<ConnectionFactory> m_connection_factory;
-    unsigned int m_idle_timeout;
-    unsigned int m_max_connections; // equal for every destination, 0: unlimited connections
-    unsigned int m_clean_interval;
+    const ConnectionPolicy m_default_policy;
     std::thread m_clean_thread;
+    std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>> m_expiries;
+    std::mutex m_clean_mtx;
+    std::condition_variable m_clean_condition;
+
+    std::thread m_warm_up_thread;
+    std::deque<WarmUp> m_warm_ups;
+    std::mutex m_warm_up_mtx;
+    std::condition_variable m_warm_up_condition;
 
     std::atomic<bool> m_stop;
-    std::mutex m_connections_mtx;
-    std::condition_variable m_connnections_condition;
 };
 
 } //namespace common
@@ -0,0 +1,90 @@
+#ifndef DESTINATIONREGISTRY_H
+#define DESTINATIONREGISTRY_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * The objects of type T shared by every client of a destination, e.g. its
+ * endpoints, budgets or stats, whatever thread the clients run on. An
+ * object is created on first use and kept for the process lifetime. The
+ * key is the destination, with whatever tells apart several objects of
+ * the same type for one destination.
+ */
+template <typename T>
+class DestinationRegistry final
+{
+public:
+    DestinationRegistry() = delete;
+
+    // create makes the object on first use, called under the registry lock
+    template <typename Create>
+    static std::shared_ptr<T> get(const std::string &key, Create create)
+    {
+        Entries &entries = instance();
+        std::lock_guard<std::mutex> lock(entries.mtx);
+        std::shared_ptr<T> &entry = entries.objects[key];
+        if (!entry)
+        {
+            entry = create();
+        }
+        return entry;
+    }
+
+    static std::shared_ptr<T> get(const std::string &key)
+    {
+        return get(key, []() { return std::make_shared<T>(); });
+    }
+
+private:
+    struct Entries
+    {
+        std::mutex mtx;
+        std::unordered_map<std::string, std::shared_ptr<T>> objects;
+    };
+
+    static Entries& instance()
+    {
+        static Entries entries;
+        return entries;
+    }
+};
+
+/*
+ * A client's handle on a registry object of its destination, looked up at
+ * the first use so that every later call takes no lock. reset() drops it
+ * when the client moves to another destination.
+ */
+template <typename T>
+class DestinationBinding final
+{
+public:
+    DestinationBinding() = default;
+
+    DestinationBinding(const DestinationBinding&) = delete;
+    DestinationBinding& operator=(const DestinationBinding&) = delete;
+
+    template <typename Lookup>
+    std::shared_ptr<T> get(Lookup lookup)
+    {
+        std::shared_ptr<T> bound = std::atomic_load(&m_bound);
+        if (!bound)
+        {
+            bound = lookup();
+            std::atomic_store(&m_bound, bound);
+        }
+        return bound;
+    }
+
+    void reset()
+    {
+        std::atomic_store(&m_bound, std::shared_ptr<T>());
+    }
+
+private:
+    std::shared_ptr<T> m_bound;
+};
+
+#endif // DESTINATIONREGISTRY_H
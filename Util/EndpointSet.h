@@ -0,0 +1,354 @@
+#ifndef ENDPOINTSET_H
+#define ENDPOINTSET_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "DestinationRegistry.h"
+
+/*
+ * The replicas (host:port) serving one destination, shared by every client
+ * of the destination. A request goes to the endpoint with the fewer
+ * outstanding requests of two picked at random (power of two choices), so
+ * a slow replica gets less traffic without a global scan. After
+ * consecutive_failures failed requests in a row an endpoint is ejected,
+ * for longer each time it is ejected again, and never more than
+ * max_ejected_percent of the endpoints at once: a bad replica costs
+ * capacity, not the destination.
+ */
+class EndpointSet final
+{
+public:
+    class Endpoint
+    {
+    public:
+        explicit Endpoint(const std::string &address) : m_address(address)
+        {}
+
+        Endpoint(const Endpoint&) = delete;
+        Endpoint& operator=(const Endpoint&) = delete;
+
+        const std::string& address() const
+        {
+            return m_address;
+        }
+
+        unsigned int outstanding() const
+        {
+            return m_outstanding.load(std::memory_order_relaxed);
+        }
+
+        bool ejected() const
+        {
+            return now_ms() < m_ejected_until.load(std::memory_order_relaxed);
+        }
+
+    private:
+        friend class EndpointSet;
+
+        const std::string m_address;
+        std::atomic<unsigned int> m_outstanding{0};
+        std::atomic<unsigned int> m_consecutive_failures{0};
+        std::atomic<unsigned int> m_ejections{0};
+        std::atomic<int64_t> m_ejected_until{0}; // unit: millisecond of steady_clock
+    };
+
+    // An endpoint picked for a request, outstanding until released or destroyed
+    class Lease
+    {
+    public:
+        Lease() = default;
+        ~Lease()
+        {
+            if (m_endpoint)
+            {
+                --m_endpoint->m_outstanding;
+            }
+        }
+
+        Lease(Lease &&other) : m_set(std::move(other.m_set)), m_endpoint(std::move(other.m_endpoint))
+        {
+            other.m_set.reset();
+            other.m_endpoint.reset();
+        }
+
+        Lease& operator=(Lease &&other)
+        {
+            if (this != &other)
+            {
+                if (m_endpoint)
+                {
+                    --m_endpoint->m_outstanding;
+                }
+                m_set = std::move(other.m_set);
+                m_endpoint = std::move(other.m_endpoint);
+                other.m_set.reset();
+                other.m_endpoint.reset();
+            }
+            return *this;
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        explicit operator bool() const
+        {
+            return m_endpoint != nullptr;
+        }
+
+        const Endpoint* endpoint() const
+        {
+            return m_endpoint.get();
+        }
+
+        const std::string& address() const
+        {
+            return m_endpoint->address();
+        }
+
+        // outcome of the request, true when this failure ejected the endpoint
+        bool release(bool success)
+        {
+            if (!m_endpoint)
+            {
+                return false;
+            }
+            const bool ejected = m_set->report(*m_endpoint, success);
+            --m_endpoint->m_outstanding;
+            m_endpoint.reset();
+            m_set.reset();
+            return ejected;
+        }
+
+    private:
+        friend class EndpointSet;
+
+        std::shared_ptr<EndpointSet> m_set;
+        std::shared_ptr<Endpoint> m_endpoint;
+    };
+
+    EndpointSet() = default;
+
+    EndpointSet(const EndpointSet&) = delete;
+    EndpointSet& operator=(const EndpointSet&) = delete;
+
+    // endpoints kept from the previous set keep their health, empty: no endpoint to pick.
+    // Returns the addresses of the previous set left out of this one
+    std::vector<std::string> set_endpoints(const std::vector<std::string> &addresses)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        const std::shared_ptr<const Endpoints> current = std::atomic_load(&m_endpoints);
+        std::shared_ptr<Endpoints> endpoints = std::make_shared<Endpoints>();
+        for (const std::string &address : addresses)
+        {
+            auto iter = std::find_if(current->begin(), current->end(),
+                                     [&address](const std::shared_ptr<Endpoint> &endpoint) { return endpoint->address() == address; });
+            endpoints->push_back(iter != current->end() ? *iter : std::make_shared<Endpoint>(address));
+        }
+        std::vector<std::string> removed;
+        for (const std::shared_ptr<Endpoint> &endpoint : *current)
+        {
+            if (std::find(addresses.begin(), addresses.end(), endpoint->address()) == addresses.end())
+            {
+                removed.push_back(endpoint->address());
+            }
+        }
+        std::atomic_store(&m_endpoints, std::shared_ptr<const Endpoints>(endpoints));
+        return removed;
+    }
+
+    /*
+     * base_ejection is doubled for every ejection in a row, up to
+     * max_ejection. An endpoint healthy for max_ejection after its last
+     * ejection starts over from base_ejection.
+    */
+    void set_ejection(unsigned int consecutive_failures,
+                      std::chrono::milliseconds base_ejection,
+                      std::chrono::milliseconds max_ejection,
+                      unsigned int max_ejected_percent)
+    {
+        m_consecutive_failures = std::max(consecutive_failures, 1u);
+        m_base_ejection = base_ejection.count();
+        m_max_ejection = std::max(max_ejection, base_ejection).count();
+        m_max_ejected_percent = std::min(max_ejected_percent, 100u);
+    }
+
+    size_t size() const
+    {
+        return std::atomic_load(&m_endpoints)->size();
+    }
+
+    std::vector<std::shared_ptr<const Endpoint>> endpoints() const
+    {
+        const std::shared_ptr<const Endpoints> endpoints = std::atomic_load(&m_endpoints);
+        return std::vector<std::shared_ptr<const Endpoint>>(endpoints->begin(), endpoints->end());
+    }
+
+    /*
+     * The less loaded of two endpoints picked at random among those not
+     * ejected, avoid is only taken when it is the last one left, e.g. by
+     * the retry of a request which failed on it. Empty without endpoints.
+    */
+    static Lease pick(const std::shared_ptr<EndpointSet> &set, const Endpoint *avoid = nullptr)
+    {
+        Lease lease;
+        const std::shared_ptr<const Endpoints> endpoints = std::atomic_load(&set->m_endpoints);
+        const size_t n = endpoints->size();
+        if (n == 0)
+        {
+            return lease;
+        }
+
+        static thread_local std::minstd_rand random(std::random_device{}());
+        std::shared_ptr<Endpoint> best;
+        const size_t first = random() % n;
+        const size_t draws[2] = {first, n > 1 ? (first + 1 + random() % (n - 1)) % n : first};
+        for (const size_t draw : draws)
+        {
+            const std::shared_ptr<Endpoint> &candidate = (*endpoints)[draw];
+            if (candidate->ejected() || candidate.get() == avoid)
+            {
+                continue;
+            }
+            if (!best || candidate->outstanding() < best->outstanding())
+            {
+                best = candidate;
+            }
+        }
+        if (!best)
+        {
+            // both draws missed, take the first usable one from a random start
+            const size_t start = random() % n;
+            for (size_t i = 0; i < n && !best; ++i)
+            {
+                const std::shared_ptr<Endpoint> &candidate = (*endpoints)[(start + i) % n];
+                if (!candidate->ejected() && candidate.get() != avoid)
+                {
+                    best = candidate;
+                }
+            }
+        }
+        if (!best)
+        {
+            // nothing else is usable, every pick left goes to the same place
+            best = (*endpoints)[random() % n];
+        }
+
+        ++best->m_outstanding;
+        lease.m_set = set;
+        lease.m_endpoint = best;
+        return lease;
+    }
+
+    static std::shared_ptr<EndpointSet> of(const std::string &destination)
+    {
+        return DestinationRegistry<EndpointSet>::get(destination);
+    }
+
+    // the addresses host resolves to, as address:port, for set_endpoints
+    static std::vector<std::string> resolve(const std::string &host, unsigned int port)
+    {
+        std::vector<std::string> addresses;
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0)
+        {
+            return addresses;
+        }
+        for (const addrinfo *info = result; info; info = info->ai_next)
+        {
+            char text[INET6_ADDRSTRLEN] = {};
+            std::string address;
+            if (info->ai_family == AF_INET &&
+                inet_ntop(AF_INET, &((const sockaddr_in*)info->ai_addr)->sin_addr, text, sizeof(text)))
+            {
+                address = text;
+            }
+            else if (info->ai_family == AF_INET6 &&
+                     inet_ntop(AF_INET6, &((const sockaddr_in6*)info->ai_addr)->sin6_addr, text, sizeof(text)))
+            {
+                address = std::string("[") + text + "]";
+            }
+            else
+            {
+                continue;
+            }
+            address += ":" + std::to_string(port);
+            if (std::find(addresses.begin(), addresses.end(), address) == addresses.end())
+            {
+                addresses.push_back(address);
+            }
+        }
+        freeaddrinfo(result);
+        return addresses;
+    }
+
+private:
+    using Endpoints = std::vector<std::shared_ptr<Endpoint>>;
+
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool report(Endpoint &endpoint, bool success)
+    {
+        if (success)
+        {
+            endpoint.m_consecutive_failures.store(0, std::memory_order_relaxed);
+            if (endpoint.m_ejections.load(std::memory_order_relaxed) != 0 &&
+                now_ms() - endpoint.m_ejected_until.load(std::memory_order_relaxed) > m_max_ejection.load())
+            {
+                endpoint.m_ejections.store(0, std::memory_order_relaxed);
+            }
+            return false;
+        }
+
+        if (endpoint.m_consecutive_failures.fetch_add(1, std::memory_order_relaxed) + 1 < m_consecutive_failures.load())
+        {
+            return false;
+        }
+
+        // rare, a lock keeps the ejected ratio exact
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (endpoint.ejected())
+        {
+            return false;
+        }
+        const std::shared_ptr<const Endpoints> endpoints = std::atomic_load(&m_endpoints);
+        const size_t ejected = std::count_if(endpoints->begin(), endpoints->end(),
+                                             [](const std::shared_ptr<Endpoint> &e) { return e->ejected(); });
+        if ((ejected + 1) * 100 > m_max_ejected_percent.load() * endpoints->size())
+        {
+            return false;
+        }
+
+        const unsigned int ejections = std::min(endpoint.m_ejections.fetch_add(1, std::memory_order_relaxed), 16u);
+        const int64_t duration = std::min(m_base_ejection.load() << ejections, m_max_ejection.load());
+        endpoint.m_ejected_until.store(now_ms() + duration, std::memory_order_relaxed);
+        endpoint.m_consecutive_failures.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    std::mutex m_mtx;   // updates of the endpoints and the ejection decision
+    std::shared_ptr<const Endpoints> m_endpoints = std::make_shared<const Endpoints>();
+
+    std::atomic<unsigned int> m_consecutive_failures{5};
+    std::atomic<int64_t> m_base_ejection{30000};   // unit: millisecond
+    std::atomic<int64_t> m_max_ejection{300000};   // unit: millisecond
+    std::atomic<unsigned int> m_max_ejected_percent{50};
+};
+
+#endif // ENDPOINTSET_H
@@ -0,0 +1,149 @@
+#ifndef HALFOPENSTATE_H
+#define HALFOPENSTATE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "DestinationRegistry.h"
+
+/*
+ * The half-open recovery of one destination, shared by every client of the
+ * destination like the recovery trigger: all of them let the same share of
+ * their requests through, and the outcomes of a step are counted together.
+ * The ramp is copied when entering half-open, a client changing its own
+ * ramp meanwhile does not affect the recovery in progress. Whichever
+ * client completes the ramp, the others see it from closes().
+ */
+class HalfOpenState final
+{
+public:
+    enum Outcome
+    {
+        HALF_OPEN_INACTIVE, // not half-open
+        HALF_OPEN_COUNTED,  // the step goes on
+        HALF_OPEN_NEXT,     // the step passed, the next one lets more requests through
+        HALF_OPEN_REOPEN,   // the step can no longer pass, open again
+        HALF_OPEN_CLOSE,    // the last step passed, close
+    };
+
+    HalfOpenState() = default;
+
+    HalfOpenState(const HalfOpenState&) = delete;
+    HalfOpenState& operator=(const HalfOpenState&) = delete;
+
+    // start at the first step of ramp, false when ramp is empty. A ramp in progress goes on unchanged.
+    // A step lets at least 1 percent through: at 0 nothing would be reported and the step never end
+    bool enter(const std::vector<unsigned int> &ramp, unsigned int step_requests, double step_success_ratio)
+    {
+        if (ramp.empty())
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_percent.load() >= 0)
+        {
+            return true;
+        }
+        m_ramp = ramp;
+        for (unsigned int &step : m_ramp)
+        {
+            step = std::min(std::max(step, 1u), 100u);
+        }
+        m_step_requests = std::max(step_requests, 1u);
+        // rounded down, with room for the error of the ratio: 10 * (1 - 0.9) allows 1 failure, not 0
+        m_allowed_failures = (unsigned int)std::floor(std::max(m_step_requests * (1 - step_success_ratio), 0.0) + 1e-9);
+        m_step = 0;
+        m_successes = 0;
+        m_failures = 0;
+        m_percent = (int)m_ramp[0];
+        return true;
+    }
+
+    // percent of the requests let through at the current step, -1 when not half-open
+    int percent() const
+    {
+        return m_percent.load();
+    }
+
+    // ramps completed so far, a client in fuse mode since before the last one leaves fuse mode
+    uint64_t closes() const
+    {
+        return m_closes.load();
+    }
+
+    // false when not half-open, admitted: the request is in the share let through
+    bool admit(bool &admitted)
+    {
+        const int percent = m_percent.load();
+        if (percent < 0)
+        {
+            return false;
+        }
+        // spread evenly, percent of every hundred requests go through, not the first percent of them
+        const unsigned int ticket = m_ticket.fetch_add(1) % 100;
+        admitted = ticket * percent % 100 < (unsigned int)percent;
+        return true;
+    }
+
+    // outcome of an admitted request. percent: of the step taken, or of the step failed; failures: of the step
+    Outcome report(bool success, unsigned int &percent, unsigned int &failures)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_percent.load() < 0)
+        {
+            return HALF_OPEN_INACTIVE;
+        }
+        success ? ++m_successes : ++m_failures;
+        percent = m_ramp[m_step];
+        failures = m_failures;
+
+        // the step can no longer reach the success ratio, back to open
+        if (m_failures > m_allowed_failures)
+        {
+            m_percent = -1;
+            return HALF_OPEN_REOPEN;
+        }
+        if (m_successes + m_failures < m_step_requests)
+        {
+            return HALF_OPEN_COUNTED;
+        }
+
+        m_successes = 0;
+        m_failures = 0;
+        if (++m_step < m_ramp.size())
+        {
+            percent = m_ramp[m_step];
+            m_percent = (int)percent;
+            return HALF_OPEN_NEXT;
+        }
+        // counted first, a client seeing the state inactive also sees the close
+        ++m_closes;
+        m_percent = -1;
+        return HALF_OPEN_CLOSE;
+    }
+
+    static std::shared_ptr<HalfOpenState> of(const std::string &destination)
+    {
+        return DestinationRegistry<HalfOpenState>::get(destination);
+    }
+
+private:
+    std::atomic<int> m_percent{-1};     // of the current step, -1 when closed or open
+    std::atomic<unsigned int> m_ticket{0};
+    std::atomic<uint64_t> m_closes{0};
+
+    std::mutex m_mtx;   // the step and its counters
+    std::vector<unsigned int> m_ramp;
+    size_t m_step = 0;
+    unsigned int m_step_requests = 1;
+    unsigned int m_allowed_failures = 0;   // in a step, from the success ratio
+    unsigned int m_successes = 0;
+    unsigned int m_failures = 0;
+};
+
+#endif // HALFOPENSTATE_H
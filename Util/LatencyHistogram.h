@@ -0,0 +1,131 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Log-linear histogram of durations in microseconds: every power of two is
+ * split into sub_buckets linear buckets, so a bucket is about 3% wide and a
+ * percentile, interpolated within its bucket, is off by less than that.
+ * Recording is a few relaxed atomic increments, no lock, and any thread can
+ * read percentiles while others record.
+ */
+class LatencyHistogram final {
+public:
+    LatencyHistogram()
+    {
+        reset();
+    }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(std::chrono::microseconds value)
+    {
+        const uint64_t v = value.count() > 0 ? value.count() : 0;
+        m_buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const
+    {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::microseconds mean() const
+    {
+        const uint64_t n = count();
+        return std::chrono::microseconds(n ? m_sum.load(std::memory_order_relaxed) / n : 0);
+    }
+
+    // percent in [0, 100], interpolated within the bucket holding it
+    std::chrono::microseconds percentile(double percent) const
+    {
+        const uint64_t n = count();
+        if (n == 0)
+        {
+            return std::chrono::microseconds(0);
+        }
+        const uint64_t rank = rank_of(percent, n);
+
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < bucket_count; ++i)
+        {
+            const uint64_t in_bucket = m_buckets[i].load(std::memory_order_relaxed);
+            seen += in_bucket;
+            if (seen >= rank)
+            {
+                return interpolate(i, rank - (seen - in_bucket), in_bucket);
+            }
+        }
+        return std::chrono::microseconds(lower_bound(bucket_count) - 1);
+    }
+
+    // not atomic with concurrent record, good enough to start a new period
+    void reset()
+    {
+        for (std::atomic<uint64_t> &bucket : m_buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+    }
+
+    // bucket layout, shared with WindowedLatencyHistogram
+    static constexpr unsigned int sub_bits = 5;
+    static constexpr unsigned int sub_buckets = 1u << sub_bits;
+    static constexpr unsigned int max_exponent = 40; // about 12 days, longer values share the last bucket
+    static constexpr unsigned int bucket_count = sub_buckets + (max_exponent - sub_bits + 1) * sub_buckets;
+
+    static unsigned int bucket_of(uint64_t v)
+    {
+        if (v < sub_buckets)
+        {
+            return (unsigned int)v;
+        }
+        unsigned int exponent = 63 - __builtin_clzll(v);
+        if (exponent > max_exponent)
+        {
+            return bucket_count - 1;
+        }
+        const unsigned int sub = (unsigned int)(v >> (exponent - sub_bits)) & (sub_buckets - 1);
+        return sub_buckets + (exponent - sub_bits) * sub_buckets + sub;
+    }
+
+    static uint64_t lower_bound(unsigned int bucket)
+    {
+        if (bucket < sub_buckets)
+        {
+            return bucket;
+        }
+        const unsigned int exponent = (bucket - sub_buckets) / sub_buckets + sub_bits;
+        const uint64_t sub = (bucket - sub_buckets) % sub_buckets;
+        return (sub_buckets + sub) << (exponent - sub_bits);
+    }
+
+    // the value of rank in [1, count], rank 1 the smallest
+    static uint64_t rank_of(double percent, uint64_t count)
+    {
+        const uint64_t rank = (uint64_t)(percent / 100 * count + 0.5);
+        return rank == 0 ? 1 : (rank > count ? count : rank);
+    }
+
+    // the rank-th of the count values of bucket, taking them evenly spread over it
+    static std::chrono::microseconds interpolate(unsigned int bucket, uint64_t rank, uint64_t count)
+    {
+        const uint64_t lower = lower_bound(bucket);
+        const uint64_t width = lower_bound(bucket + 1) - lower;
+        return std::chrono::microseconds(lower + (uint64_t)(width * (rank - 0.5) / count));
+    }
+
+private:
+    std::atomic<uint64_t> m_buckets[bucket_count];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,184 @@
+#ifndef RECOVERYSCHEDULER_H
+#define RECOVERYSCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Timer queue run by a small, bounded set of worker threads, shared by all
+ * the fuse clients of the process. A tripped client schedules its next
+ * health probe instead of owning a thread that sleeps, so an outage of many
+ * destinations costs tasks, not threads. Tasks belong to an owner, whose
+ * pending tasks are all canceled at once when it goes away.
+ */
+class RecoveryScheduler final
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit RecoveryScheduler(unsigned int workers = 2)
+    {
+        for (unsigned int i = 0; i < std::max(workers, 1u); ++i)
+        {
+            m_workers.emplace_back(&RecoveryScheduler::work, this);
+        }
+    }
+
+    ~RecoveryScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stop = true;
+        }
+        m_condition.notify_all();
+        for (std::thread &worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    RecoveryScheduler(const RecoveryScheduler&) = delete;
+    RecoveryScheduler& operator=(const RecoveryScheduler&) = delete;
+
+    void schedule(const void *owner, std::chrono::steady_clock::time_point when, Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            const TaskId id = ++m_last_id;
+            m_tasks.emplace(id, Pending{owner, std::move(task)});
+            m_queue.push(Entry{when, id});
+        }
+        m_condition.notify_all();
+    }
+
+    /*
+     * No task of owner runs after this returns: pending ones are dropped, a
+     * running one is waited for, unless cancel is called from that task, and
+     * what it scheduled meanwhile is dropped too.
+    */
+    void cancel(const void *owner)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        drop_tasks(owner);
+        m_done_condition.wait(lock, [this, owner]()
+        {
+            auto range = m_running.equal_range(owner);
+            for (auto iter = range.first; iter != range.second; ++iter)
+            {
+                if (iter->second != std::this_thread::get_id())
+                {
+                    return false;
+                }
+            }
+            return true;
+        });
+        drop_tasks(owner);
+    }
+
+    // created on first use, clients keep it alive while they need it
+    static std::shared_ptr<RecoveryScheduler> instance()
+    {
+        static std::shared_ptr<RecoveryScheduler> scheduler = std::make_shared<RecoveryScheduler>();
+        return scheduler;
+    }
+
+private:
+    using TaskId = uint64_t;
+
+    struct Pending
+    {
+        const void *owner;
+        Task task;
+    };
+
+    struct Entry
+    {
+        std::chrono::steady_clock::time_point when;
+        TaskId id;
+
+        bool operator>(const Entry &other) const
+        {
+            return when > other.when;
+        }
+    };
+
+    // with m_mtx held, their queue entries are skipped when due
+    void drop_tasks(const void *owner)
+    {
+        for (auto iter = m_tasks.begin(); iter != m_tasks.end();)
+        {
+            iter = iter->second.owner == owner ? m_tasks.erase(iter) : std::next(iter);
+        }
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        while (!m_stop)
+        {
+            if (m_queue.empty())
+            {
+                m_condition.wait(lock);
+                continue;
+            }
+            const Entry entry = m_queue.top();
+            if (std::chrono::steady_clock::now() < entry.when)
+            {
+                m_condition.wait_until(lock, entry.when);
+                continue;
+            }
+            m_queue.pop();
+
+            auto iter = m_tasks.find(entry.id);
+            if (iter == m_tasks.end())
+            {
+                continue;   // canceled
+            }
+            const void *owner = iter->second.owner;
+            Task task = std::move(iter->second.task);
+            m_tasks.erase(iter);
+            m_running.emplace(owner, std::this_thread::get_id());
+
+            lock.unlock();
+            task();
+            lock.lock();
+
+            // iterators do not survive a rehash, look the entry up again
+            auto range = m_running.equal_range(owner);
+            for (auto iter = range.first; iter != range.second; ++iter)
+            {
+                if (iter->second == std::this_thread::get_id())
+                {
+                    m_running.erase(iter);
+                    break;
+                }
+            }
+            m_done_condition.notify_all();
+        }
+    }
+
+private:
+    std::mutex m_mtx;
+    std::condition_variable m_condition;       // new task or stop
+    std::condition_variable m_done_condition;  // a task finished
+    bool m_stop = false;
+    TaskId m_last_id = 0;
+
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> m_queue;
+    std::unordered_map<TaskId, Pending> m_tasks;                    // pending
+    std::unordered_multimap<const void*, std::thread::id> m_running; // owner of a running task and its worker
+
+    std::vector<std::thread> m_workers;
+};
+
+#endif // RECOVERYSCHEDULER_H
@@ -4,20 +4,49 @@
 #include <chrono>
 #include <vector>
 #include <cassert>
-#include <mutex>
-#include <numeric>
-#include <cstring>
-
-using SlideWindowUnit = std::chrono::seconds;
-
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+// resolution of the slices
+using SlideWindowUnit = std::chrono::milliseconds;
+
+/*
+ * Counts over a sliding window of count slices, without a lock.
+ *
+ * Threads add to their own shard, each on its own cache line, so reporting
+ * threads do not contend. A slot is stamped with the slice it counts
+ * (epoch) and is reused by the first writer of a later slice instead of
+ * being zeroed eagerly. Every shard keeps the running sum of its window,
+ * so the sum of the whole window costs one load per shard.
+ */
 class TimerCounter final {
 public:
+    // interval: length of a slice in seconds
     explicit TimerCounter(unsigned int interval = 60, unsigned int count = 60) :
-        m_interval(interval),
-        m_data(count, 0)
+        TimerCounter(std::chrono::seconds(interval), count)
     {
-        assert(interval > 0);
+    }
+
+    TimerCounter(SlideWindowUnit slice, unsigned int count) :
+        m_slice(slice.count()),
+        m_count(count),
+        m_shards(shard_count())
+    {
+        assert(slice.count() > 0);
         assert(count > 0);
+        const uint64_t now = current_epoch();
+        for (Shard &shard : m_shards)
+        {
+            shard.slots.reset(new std::atomic<uint64_t>[count]);
+            for (unsigned int i = 0; i < count; ++i)
+            {
+                shard.slots[i].store(0, std::memory_order_relaxed);
+            }
+            shard.head.store(now, std::memory_order_relaxed);
+        }
     }
 
 
@@ -26,77 +55,172 @@ public:
     TimerCounter& operator=(const TimerCounter&) = delete;
     TimerCounter& operator=(const TimerCounter&&) = delete;
 
+    // not atomic with concurrent add_count, those may be kept or dropped
     void reset()
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        resetWithoutLock();
+        for (Shard &shard : m_shards)
+        {
+            for (unsigned int i = 0; i < m_count; ++i)
+            {
+                const uint64_t old = shard.slots[i].exchange(0, std::memory_order_relaxed);
+                shard.sum.fetch_sub(count_of(old), std::memory_order_relaxed);
+            }
+        }
     }
 
     void add_count(unsigned int c)
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        refresh_data();
-        m_data[m_current] += c;
+        const uint64_t now = current_epoch();
+        Shard &shard = m_shards[shard_index()];
+        advance(shard, now);
+
+        std::atomic<uint64_t> &slot = shard.slots[now % m_count];
+        uint64_t old = slot.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if (epoch_of(old) == now)
+            {
+                const uint64_t sum = std::min<uint64_t>(count_of(old) + c, max_slot_count);
+                if (slot.compare_exchange_weak(old, pack(now, sum), std::memory_order_relaxed))
+                {
+                    shard.sum.fetch_add(sum - count_of(old), std::memory_order_relaxed);
+                    return;
+                }
+            }
+            else if (epoch_of(old) < now)
+            {
+                // still holds an expired slice, the writer that recycles it takes its count out of the sum
+                const uint64_t sum = std::min<uint64_t>(c, max_slot_count);
+                if (slot.compare_exchange_weak(old, pack(now, sum), std::memory_order_relaxed))
+                {
+                    shard.sum.fetch_add(sum - count_of(old), std::memory_order_relaxed);
+                    return;
+                }
+            }
+            else
+            {
+                return; // the clock moved on a whole window while this thread was preempted
+            }
+        }
     }
 
+    /*
+     * O(shards) for the whole window, which is what a fuse asks for,
+     * O(count * shards) for a shorter one.
+     */
     unsigned int get_sum_of_last_slices(unsigned int count)
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        refresh_data();
-
-        unsigned int sum = 0;
-        if (count >= m_data.size())
+        const uint64_t now = current_epoch();
+        int64_t sum = 0;
+        if (count >= m_count)
         {
-            sum = std::accumulate(m_data.begin(), m_data.end(), sum);
+            for (Shard &shard : m_shards)
+            {
+                advance(shard, now);
+                sum += shard.sum.load(std::memory_order_relaxed);
+            }
         }
         else
         {
-            std::vector<unsigned int>::size_type pos = m_current;
-            for (int i = 0; i < count; ++i)
+            for (Shard &shard : m_shards)
             {
-                sum += m_data[pos];
-                pos = (pos - 1 + m_data.size()) % m_data.size();
+                for (unsigned int i = 0; i < count; ++i)
+                {
+                    const uint64_t value = shard.slots[(now - i) % m_count].load(std::memory_order_relaxed);
+                    if (epoch_of(value) == now - i)
+                    {
+                        sum += count_of(value);
+                    }
+                }
             }
         }
 
-        return sum;
+        // the sum and the slots are updated one after the other, a reader in between may see the sum off by a slot
+        return sum > 0 ? (unsigned int)sum : 0;
     }
 
 private:
-    void resetWithoutLock()
+    struct alignas(64) Shard
     {
-        memset(&m_data[0], 0, sizeof(m_data[0]) * m_data.size());
-    }
+        std::unique_ptr<std::atomic<uint64_t>[]> slots; // epoch << count_bits | count
+        std::atomic<int64_t> sum{0};                    // of the slots in the window
+        std::atomic<uint64_t> head{0};                  // latest epoch whose expired slot has been taken out of sum
+    };
 
-    void refresh_data()
+    // take the slices which left the window out of the sum of the shard
+    void advance(Shard &shard, uint64_t now)
     {
-        const SlideWindowUnit::rep now = std::chrono::duration_cast<SlideWindowUnit>(std::chrono::steady_clock::now().time_since_epoch()).count() / m_interval;
-        const int delta = now - m_last;
-        if (delta >= m_data.size())
+        uint64_t head = shard.head.load(std::memory_order_relaxed);
+        while (head < now)
         {
-            resetWithoutLock();
+            if (shard.head.compare_exchange_weak(head, now, std::memory_order_relaxed))
+            {
+                // after a long idle period only the m_count latest epochs have a slot to empty
+                const uint64_t first = std::max(head + 1, now >= m_count ? now - m_count + 1 : 0);
+                for (uint64_t epoch = first; epoch <= now; ++epoch)
+                {
+                    expire(shard, epoch);
+                }
+                return;
+            }
         }
-        else
+    }
+
+    // slot of epoch, if it still holds an older slice, is emptied for epoch
+    void expire(Shard &shard, uint64_t epoch)
+    {
+        std::atomic<uint64_t> &slot = shard.slots[epoch % m_count];
+        uint64_t old = slot.load(std::memory_order_relaxed);
+        while (epoch_of(old) < epoch)
         {
-            for (int i = 0; i < delta; ++i)
+            if (slot.compare_exchange_weak(old, pack(epoch, 0), std::memory_order_relaxed))
             {
-                m_current = (m_current + 1) % m_data.size();
-                m_data[m_current] = 0;
+                shard.sum.fetch_sub(count_of(old), std::memory_order_relaxed);
+                break;
             }
         }
-        m_last = now;
     }
 
+    uint64_t current_epoch() const
+    {
+        return std::chrono::duration_cast<SlideWindowUnit>(std::chrono::steady_clock::now().time_since_epoch()).count() / m_slice;
+    }
 
-private:
-    const unsigned int m_interval;
+    unsigned int shard_index() const
+    {
+        static std::atomic<unsigned int> next_thread{0};
+        static thread_local unsigned int thread_index = next_thread.fetch_add(1, std::memory_order_relaxed);
+        return thread_index % m_shards.size();
+    }
 
-    std::vector<unsigned int> m_data;
-    std::vector<unsigned int>::size_type m_current = 0;
-    SlideWindowUnit::rep m_last = 0;
+    static unsigned int shard_count()
+    {
+        return std::max(1u, std::min(std::thread::hardware_concurrency(), max_shards));
+    }
 
-    std::mutex m_mutex;
+    static constexpr unsigned int count_bits = 24;
+    static constexpr uint64_t max_slot_count = (1ull << count_bits) - 1;
+    static constexpr unsigned int max_shards = 8;
+
+    static uint64_t pack(uint64_t epoch, uint64_t count)
+    {
+        return epoch << count_bits | count;
+    }
+
+    static uint64_t epoch_of(uint64_t value)
+    {
+        return value >> count_bits;
+    }
+
+    static uint64_t count_of(uint64_t value)
+    {
+        return value & max_slot_count;
+    }
+
+private:
+    const SlideWindowUnit::rep m_slice;
+    const unsigned int m_count;
+    std::vector<Shard> m_shards;
 };
 
 #endif // TIMERCOUNTER_H
-
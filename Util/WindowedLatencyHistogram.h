@@ -0,0 +1,205 @@
+#ifndef WINDOWEDLATENCYHISTOGRAM_H
+#define WINDOWEDLATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DestinationRegistry.h"
+#include "LatencyHistogram.h"
+#include "TimerCounter.h"
+
+/*
+ * LatencyHistogram over a sliding window of count slices, the latency
+ * counterpart of TimerCounter. Every slice holds its own buckets stamped
+ * with the slice (epoch) they count. The first writer of a new slice
+ * empties the buckets it reuses, the others go on without a lock.
+ * Percentiles cost a pass over the buckets of the window, so callers
+ * should not ask for one per request.
+ */
+class WindowedLatencyHistogram final {
+public:
+    WindowedLatencyHistogram(SlideWindowUnit slice, unsigned int count) :
+        m_slice(slice.count()),
+        m_slices(count)
+    {
+        assert(slice.count() > 0);
+        assert(count > 0);
+        for (Slice &s : m_slices)
+        {
+            s.buckets.reset(new std::atomic<uint32_t>[LatencyHistogram::bucket_count]);
+            for (unsigned int i = 0; i < LatencyHistogram::bucket_count; ++i)
+            {
+                s.buckets[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    WindowedLatencyHistogram(const WindowedLatencyHistogram&) = delete;
+    WindowedLatencyHistogram& operator=(const WindowedLatencyHistogram&) = delete;
+
+    void record(std::chrono::microseconds value)
+    {
+        const uint64_t now = current_epoch();
+        Slice &slice = m_slices[now % m_slices.size()];
+
+        uint64_t epoch = slice.epoch.load(std::memory_order_acquire);
+        while (epoch != now)
+        {
+            if (epoch & clearing)
+            {
+                std::this_thread::yield();  // another writer is emptying the slice
+                epoch = slice.epoch.load(std::memory_order_acquire);
+            }
+            else if (epoch > now)
+            {
+                return; // the clock moved on a whole window while this thread was preempted
+            }
+            else if (slice.epoch.compare_exchange_weak(epoch, now | clearing, std::memory_order_acquire))
+            {
+                for (unsigned int i = 0; i < LatencyHistogram::bucket_count; ++i)
+                {
+                    slice.buckets[i].store(0, std::memory_order_relaxed);
+                }
+                slice.epoch.store(now, std::memory_order_release);
+                break;
+            }
+        }
+
+        const uint64_t v = value.count() > 0 ? value.count() : 0;
+        slice.buckets[LatencyHistogram::bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // percent in [0, 100] over the window, interpolated within the bucket holding it. requests: values in the window
+    std::chrono::microseconds percentile(double percent, uint64_t &requests) const
+    {
+        const uint64_t now = current_epoch();
+        std::vector<uint64_t> counts(LatencyHistogram::bucket_count, 0);
+        requests = 0;
+        for (const Slice &slice : m_slices)
+        {
+            const uint64_t epoch = slice.epoch.load(std::memory_order_acquire);
+            if ((epoch & clearing) || epoch == 0 || epoch > now || now - epoch >= m_slices.size())
+            {
+                continue;
+            }
+            for (unsigned int i = 0; i < LatencyHistogram::bucket_count; ++i)
+            {
+                const uint32_t count = slice.buckets[i].load(std::memory_order_relaxed);
+                counts[i] += count;
+                requests += count;
+            }
+        }
+        if (requests == 0)
+        {
+            return std::chrono::microseconds(0);
+        }
+
+        const uint64_t rank = LatencyHistogram::rank_of(percent, requests);
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < LatencyHistogram::bucket_count; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                return LatencyHistogram::interpolate(i, rank - (seen - counts[i]), counts[i]);
+            }
+        }
+        return std::chrono::microseconds(LatencyHistogram::lower_bound(LatencyHistogram::bucket_count) - 1);
+    }
+
+    // the buckets are emptied when their slice is reused
+    void reset()
+    {
+        for (Slice &slice : m_slices)
+        {
+            uint64_t epoch = slice.epoch.load(std::memory_order_relaxed);
+            while (!(epoch & clearing) && !slice.epoch.compare_exchange_weak(epoch, 0, std::memory_order_relaxed))
+            {
+            }
+        }
+    }
+
+    /*
+     * The histogram of destination over count slices. Clients of the
+     * destination asking for the same window share it, purpose tells apart
+     * the histograms of one destination, e.g. the latency fuse and hedging.
+    */
+    static std::shared_ptr<WindowedLatencyHistogram> of(const std::string &destination,
+                                                        SlideWindowUnit slice,
+                                                        unsigned int count,
+                                                        const std::string &purpose = "fuse")
+    {
+        const std::string key = purpose + " " + destination + "/" + std::to_string(slice.count()) + "x" + std::to_string(count);
+        return DestinationRegistry<WindowedLatencyHistogram>::get(key,
+            [slice, count]() { return std::make_shared<WindowedLatencyHistogram>(slice, count); });
+    }
+
+private:
+    struct Slice
+    {
+        std::atomic<uint64_t> epoch{0};    // 0: empty
+        std::unique_ptr<std::atomic<uint32_t>[]> buckets;
+    };
+
+    static constexpr uint64_t clearing = 1ull << 63;
+
+    uint64_t current_epoch() const
+    {
+        return std::chrono::duration_cast<SlideWindowUnit>(std::chrono::steady_clock::now().time_since_epoch()).count() / m_slice;
+    }
+
+private:
+    const SlideWindowUnit::rep m_slice;
+    std::vector<Slice> m_slices;
+};
+
+/*
+ * A percentile of a WindowedLatencyHistogram taken at most once a second,
+ * so callers may ask on every request without paying the pass over the
+ * buckets each time.
+ */
+class CachedPercentile final {
+public:
+    CachedPercentile() = default;
+
+    CachedPercentile(const CachedPercentile&) = delete;
+    CachedPercentile& operator=(const CachedPercentile&) = delete;
+
+    // true when this call took the percentile again, only one caller a second does
+    bool update(const WindowedLatencyHistogram &histogram, double percent)
+    {
+        const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t checked = m_checked.load();
+        if (checked == now || !m_checked.compare_exchange_strong(checked, now))
+        {
+            return false;
+        }
+        uint64_t requests = 0;
+        m_value = histogram.percentile(percent, requests).count();
+        m_requests = requests;
+        return true;
+    }
+
+    std::chrono::microseconds value() const
+    {
+        return std::chrono::microseconds(m_value.load());
+    }
+
+    // in the window when the percentile was taken
+    uint64_t requests() const
+    {
+        return m_requests.load();
+    }
+
+private:
+    std::atomic<int64_t> m_checked{0};  // second of the last percentile
+    std::atomic<int64_t> m_value{0};    // unit: microsecond
+    std::atomic<uint64_t> m_requests{0};
+};
+
+#endif // WINDOWEDLATENCYHISTOGRAM_H
@@ -0,0 +1,86 @@
+// Standalone check of the percentile error of LatencyHistogram and
+// WindowedLatencyHistogram, e.g.
+// g++ -std=c++17 -pthread -I.. LatencyHistogramTest.cpp && ./a.out
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "../Util/LatencyHistogram.h"
+#include "../Util/WindowedLatencyHistogram.h"
+
+namespace {
+
+// a percentile is within this ratio of the exact one
+const double max_error = 0.035;
+
+int failures = 0;
+
+void check(const char *name, double percent, double exact, std::chrono::microseconds value)
+{
+    const double error = std::fabs(value.count() - exact) / exact;
+    if (error > max_error)
+    {
+        printf("FAIL %s p%g: %lld, exact %.0f, error %.2f%%\n", name, percent, (long long)value.count(), exact, error * 100);
+        ++failures;
+    }
+}
+
+double exact_percentile(std::vector<int64_t> values, double percent)
+{
+    std::sort(values.begin(), values.end());
+    const uint64_t rank = LatencyHistogram::rank_of(percent, values.size());
+    return (double)values[rank - 1];
+}
+
+void check_distribution(const char *name, const std::vector<int64_t> &values)
+{
+    LatencyHistogram histogram;
+    WindowedLatencyHistogram windowed(std::chrono::seconds(60), 1);
+    for (int64_t v : values)
+    {
+        histogram.record(std::chrono::microseconds(v));
+        windowed.record(std::chrono::microseconds(v));
+    }
+    for (double percent : {50.0, 90.0, 95.0, 99.0, 99.9})
+    {
+        const double exact = exact_percentile(values, percent);
+        check(name, percent, exact, histogram.percentile(percent));
+        uint64_t requests = 0;
+        check(name, percent, exact, windowed.percentile(percent, requests));
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937_64 random(42);
+    std::vector<int64_t> values;
+
+    // around the 800 ms latency fuse, p99 at 790 ms must not read above 800 ms
+    std::uniform_int_distribution<int64_t> uniform(700000, 800000);
+    for (int i = 0; i < 100000; ++i)
+    {
+        values.push_back(uniform(random));
+    }
+    check_distribution("uniform", values);
+
+    values.clear();
+    std::lognormal_distribution<double> lognormal(std::log(20000.0), 1.0);
+    for (int i = 0; i < 100000; ++i)
+    {
+        values.push_back(std::max<int64_t>((int64_t)lognormal(random), 1000));
+    }
+    check_distribution("lognormal", values);
+
+    values.assign(1000, 790000);
+    check_distribution("constant", values);
+
+    if (failures == 0)
+    {
+        printf("OK\n");
+    }
+    return failures == 0 ? 0 : 1;
+}